@@ -8,11 +8,12 @@ from __future__ import division
 import os
 import numpy as np
 from matplotlib import pyplot as plt
+from glass.statefile import is_statefile
+from glass.scales import convert
 
 glass_basis('glass.basis.pixels', solver=None)
 exclude_all_priors()
 opts = Environment.global_opts['argv']
-gls = [loadstate(f) for f in opts[1:]]
 
 
 @command
@@ -47,9 +48,38 @@ def hubble_dist(env, **kwargs):
     return h_data
 
 
-for i, g in enumerate(gls):
-    fname = os.path.basename(g.global_opts['argv'][1+i])
-    h_data = g.hubble_dist()
+def hubble_dist_columns(state, obj_index=0, key='accepted'):
+    """
+    Same as hubble_dist, but only reads the nu (or H0) and selector columns of
+    a columnar state file instead of loading every model.
+
+    Args:
+        state <glass.statefile.StateFile object> - opened glass state file
+
+    Kwargs:
+        obj_index <int> - lens model index, in case more than one objects were modelled
+        key <str> - model selector key
+
+    Return:
+        h_data <ndarray> - Hubble constant of the selected models
+    """
+    columns = state.toc['columns']
+    stacked = lambda name: columns.get(name, {}).get('kind') == 'array'
+
+    if not stacked('model/%s' % key):
+        return state.environment().hubble_dist(obj_index=obj_index, key=key)
+    sel = state.column('model/%s' % key) == True
+    if stacked('%i/H0' % obj_index):
+        return state.column('%i/H0' % obj_index)[sel]
+    return convert('nu to H0 in km/s/Mpc', state.column('%i/nu' % obj_index)[sel])
+
+
+for f in opts[1:]:
+    fname = os.path.basename(f)
+    if is_statefile(f):
+        h_data = hubble_dist_columns(statefile(f))
+    else:
+        h_data = loadstate(f).hubble_dist()
     plt.hist(h_data, range=[50, 90], bins=20)
     plt.title(fname)
     hname = "".join(fname.split('.')[:-1] + ['_hist.png'])
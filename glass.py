@@ -30,22 +30,6 @@ def _detect_cpus():
             return ncpus
     return 1 # Default
 
-_omp_opts = None
-def _detect_omp():
-    global _omp_opts
-    if _omp_opts is not None: return _omp_opts
-    try:
-        # from scipy import weave
-        import weave
-        kw = dict( extra_compile_args = ['-O3','-fopenmp','-DWITH_OMP','-Wall','-Wno-unused-variable'], 
-                   extra_link_args = ['-lgomp'], 
-                   headers = ['<omp.h>'] )
-        #weave.inline(' ', **kw)
-    except:
-        kw = {}
-    _omp_opts = kw
-    return kw
-
 def Ximport_functions(pkg):
     f = __import__(pkg, globals(), locals())
     #print f.__dict__
@@ -77,7 +61,6 @@ if __name__ == "__main__":
 
     Environment.global_opts['ncpus_detected'] = _detect_cpus()
     Environment.global_opts['ncpus'] = 1
-    Environment.global_opts['omp_opts'] = _detect_omp()
     Environment.global_opts['withgfx'] = True
 
     Commands.set_env(Environment())
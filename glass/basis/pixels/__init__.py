@@ -9,6 +9,7 @@ from glass.command import command
 from glass.scales import convert
 
 from glass.solvers.error import GlassSolverError
+from glass.solvers.sparse_row import SparseRow
 
 from . import glcmds
 from . import funcs
@@ -24,6 +25,9 @@ elif not opts.has_key('solver') or opts['solver'] == 'rwalk':
 elif opts.has_key('solver') and opts['solver'] == 'samplex':
     from glass.solvers.samplex.samplex import Samplex
     import glass.solvers.samplex.glcmds 
+elif opts.has_key('solver') and opts['solver'] == 'revised':
+    from glass.solvers.revised.samplex import Samplex
+    import glass.solvers.revised.glcmds 
 elif opts.has_key('solver') and opts['solver'] == 'lpsolve':
     from glass.solvers.lpsolve.samplex import Samplex
     import glass.solvers.lpsolve.glcmds 
@@ -113,16 +117,16 @@ def _expand_array(nvars, offs, f, symm=None):
        stack the input equations such that the first column of the input
        always goes in the first column for the solver but the rest is
        shifted to the right by offs, which places the input into a region
-       of the solver matrix that is just for the same object."""
+       of the solver matrix that is just for the same object.
+
+       Only the nonzero coefficients are passed on, as a SparseRow."""
     def work(eq):
         if symm is not None: eq = symm(eq)
-        new_eq = zeros(nvars+1, order='Fortran')
-        new_eq[0] = eq[0]
-        new_eq[offs:offs+len(eq)-1] = eq[1:]
-        f(new_eq)
+        f(SparseRow.from_dense(eq, offs, nvars+1))
 
     return work
 
+@command
 def init_model_generator(env, nmodels, regenerate=False):
     """Construct the linear constraint equations by applying all the
        enabled priors."""
@@ -254,7 +258,8 @@ def package_solution(env, sol, objs, **kwargs):
 def fast_package_solution(env, sol, objs, fn_package_sol = None):
     return {'sol':  sol, 'tagged':  False}
 
-def check_model(objs, ps):
+@command
+def check_model(env, objs, ps):
     #Log('WARNING: checks disabled')
     #return
     for o,data in ps['obj,sol']:
@@ -279,7 +284,7 @@ def generate_models(env, objs, n, *args, **kwargs):
         ps = _particle_model(objs[0], *data)
 
         if opts.get('solver', None):
-            init_model_generator(env, n)
+            init_model_generator(n)
             check_model(objs, ps)
 
         yield ps
@@ -293,7 +298,7 @@ def generate_models(env, objs, n, *args, **kwargs):
         ps = _grid_model(objs[0], *data)
 
         if opts.get('solver', None):
-            init_model_generator(env, n)
+            init_model_generator(n)
             check_model(objs, ps)
 
         yield ps
@@ -319,7 +324,7 @@ def generate_models(env, objs, n, *args, **kwargs):
     else:
 
         if opts.get('solver', None):
-            init_model_generator(env, n)
+            init_model_generator(n)
             mg = env.model_gen
             mg.start()
             try:
@@ -13,7 +13,7 @@ from numpy import \
     conj, arctan2, atleast_2d, linspace, cumsum, sum, repeat,\
     zeros_like, ndenumerate, s_, isinf, where, dot, array, \
     add, subtract, multiply, append, ceil, ones, sort, sign, diff, \
-    trunc, argmin, logical_and, logical_not, nan_to_num, histogram2d, \
+    trunc, argmin, argsort, logical_and, logical_not, nan_to_num, histogram2d, \
     sin, cos, pi, matrix, diag, average, log, sqrt, mean, hypot
 
 from scipy.integrate import dblquad, quad, fixed_quad
@@ -24,6 +24,7 @@ if 1:
     from matplotlib.patches import Circle, Rectangle
 
 from scipy.ndimage.filters import correlate
+from scipy.sparse import csr_matrix
 from scipy.misc import central_diff_weights
 # from scipy.linalg import eig, eigh, norm
 # from scipy.signal import convolve2d
@@ -43,6 +44,7 @@ from glass.scales import convert
 from glass.handythread import parallel_map2, parallel_map
 
 from . potential import poten_dxdx, poten_dydy, maginv, poten_dxdy
+from . import cpotential
 from . lensmodel import PixelLensModel
 
 from glass.log import log as Log
@@ -50,13 +52,85 @@ from glass.log import log as Log
 np.set_printoptions(threshold=1000000)
 
 
+class PixelIndex(object):
+    """A uniform grid hash over the pixel positions R. Buckets are h on a
+       side, where h should be the smallest cell size, so even subdivided
+       regions put only a few pixels in each bucket. Boxes are padded by one
+       bucket, so callers must still apply their exact test to the
+       candidates."""
+
+    def __init__(self, R, h):
+        self.h = h
+        ix = floor(R.real / h).astype(np.int64)
+        iy = floor(R.imag / h).astype(np.int64)
+        self.x0, self.y0 = amin(ix)-1, amin(iy)-1
+        self.nx = amax(ix) - self.x0 + 2
+        self.ny = amax(iy) - self.y0 + 2
+
+        #---------------------------------------------------------------------
+        # Pixels sorted by bucket, with the bucket b holding
+        # order[start[b]:start[b+1]].
+        #---------------------------------------------------------------------
+        keys = (iy - self.y0) * self.nx + (ix - self.x0)
+        self.order = argsort(keys, kind='mergesort').astype(np.int64)
+        self.start = keys[self.order].searchsorted(arange(self.nx*self.ny+1))
+
+    def pairs(self, C, half):
+        """Candidate pixels j within half of each query center C[q] along
+           both axes. Returns (q, j) sorted by q and then j."""
+        C    = np.atleast_1d(C)
+        half = half * ones(len(C))
+        x0 = np.clip(floor((C.real-half) / self.h).astype(np.int64) - self.x0 - 1, 0, self.nx-1)
+        x1 = np.clip(floor((C.real+half) / self.h).astype(np.int64) - self.x0 + 1, 0, self.nx-1)
+        y0 = np.clip(floor((C.imag-half) / self.h).astype(np.int64) - self.y0 - 1, 0, self.ny-1)
+        y1 = np.clip(floor((C.imag+half) / self.h).astype(np.int64) - self.y0 + 1, 0, self.ny-1)
+
+        # One entry per bucket row of each query...
+        n  = y1 - y0 + 1
+        qr = repeat(arange(len(C)), n)
+        row = y0[qr] + arange(n.sum()) - repeat(cumsum(n) - n, n)
+        lo = self.start[row * self.nx + x0[qr]]
+        n  = self.start[row * self.nx + x1[qr] + 1] - lo
+
+        # ...and one per pixel in those rows.
+        q = repeat(qr, n)
+        j = self.order[arange(n.sum()) + repeat(lo - (cumsum(n) - n), n)]
+        k = lexsort((j, q))
+        return q[k], j[k]
+
+
+def split_pairs(q, j, n):
+    """Turn sorted (q, j) pairs into a list of n arrays, one per q."""
+    return np.split(j, cumsum(np.bincount(q, minlength=n))[:-1])
+
+
+def fft_size(n):
+    """The smallest integer >= n with no prime factors other than 2, 3 and 5."""
+    m = n
+    while True:
+        k = m
+        for p in [2,3,5]:
+            while k % p == 0: k //= p
+        if k == 1: return m
+        m += 1
+
+
 def neighbors(r, s, Rs):
     rs = abs(Rs-r)
     return argwhere((0 < rs) * (rs <= s)).ravel()
 
 
-def all_neighbors(Rs, L):
-    return [[i, r, neighbors(r,s,Rs)] for i,[r,s] in enumerate(izip(Rs, L))]
+def all_neighbors(Rs, L, index=None, scale=1):
+    """Pixels within L of each pixel. If a PixelIndex over Rs/scale is given
+       only nearby pixels are tested."""
+    if index is None:
+        return [[i, r, neighbors(r,s,Rs)] for i,[r,s] in enumerate(izip(Rs, L))]
+
+    L = L * ones(len(Rs))
+    q, j = index.pairs(Rs / scale, L / scale)
+    rs = abs(Rs[j]-Rs[q])
+    k = (0 < rs) * (rs <= L[q])
+    return [[i, r, n] for i,[r,n] in enumerate(izip(Rs, split_pairs(q[k], j[k], len(Rs))))]
 
 
 def in_pixel(r, R, size):
@@ -76,26 +150,44 @@ def ctrunc(c):
     return complex(trunc(c.real), trunc(c.imag))
 
 
-def _pixel_neighbors(i, r0, loc, R, size, sizes, try_hard):
+def pixels_in_boxes(loc, R, sizes, index):
+    """For each offset l in loc, the pixels whose centers lie inside the
+       cell-sized box at R[i] + l*sizes[i], for every pixel i. The result is
+       indexed as [pixel][offset]."""
+    boxes = []
+    for dx,dy in loc:
+        l = complex(dx,dy)
+        q, j = index.pairs(R + l*sizes, 0.5*sizes)
+        r = R[j]-R[q]-l*sizes[q]
+        k = (abs(r.real) < 0.5*sizes[q]) * (abs(r.imag) < 0.5*sizes[q])
+        boxes.append(split_pairs(q[k], j[k], len(R)))
+    return zip(*boxes)
+
+
+def _pixel_box(r0, l, R, size, box):
+    if box is not None: return box
+    r = R-r0-l*size
+    return where((abs(r.real) < 0.5*size) * (abs(r.imag) < 0.5*size))[0]
+
+
+def _pixel_neighbors(i, r0, loc, R, size, sizes, try_hard, boxes=None):
     n = []
-    dr = R-r0
-    for dx, dy in loc:
+    for d,[dx, dy] in enumerate(loc):
         l = complex(dx,dy)
-        r = dr-l*size
-        d = abs(r)
-        w = where((abs(r.real) < 0.5*size) * (abs(r.imag) < 0.5*size))[0]
+        w = _pixel_box(r0, l, R, size, None if boxes is None else boxes[d])
         if len(w) == 0:
             if try_hard: 
                 w = array([pixel_containing(r0+l*size, R, sizes)])
             else:
                 continue
 
-        m = w[argmin(abs(dr)[w])]
+        dr = R[w]-r0
+        m = argmin(abs(dr))
         mr = dr[m]
 
-        if [dx, dy] in [[-1, 0], [1, 0]]: w = w[where(dr[w].real == mr.real)]
-        if [dx, dy] in [[0, -1], [0, 1]]: w = w[where(dr[w].imag == mr.imag)]
-        if [dx, dy] in [[-1, -1], [1, 1], [1, -1], [-1, 1]]: w = [m]
+        if [dx, dy] in [[-1, 0], [1, 0]]: w = w[where(dr.real == mr.real)]
+        if [dx, dy] in [[0, -1], [0, 1]]: w = w[where(dr.imag == mr.imag)]
+        if [dx, dy] in [[-1, -1], [1, 1], [1, -1], [-1, 1]]: w = w[[m]]
         w = w[w != i]
         n.extend(w)
 
@@ -103,18 +195,17 @@ def _pixel_neighbors(i, r0, loc, R, size, sizes, try_hard):
     return np.array(n)
 
 
-def pixel_neighbors(loc, R, sizes, try_hard=True):
-    return [[i, r, _pixel_neighbors(i, r, loc, R, s, sizes, try_hard)] for i, [r, s] in enumerate(izip(R, sizes))]
+def pixel_neighbors(loc, R, sizes, try_hard=True, index=None):
+    boxes = [None]*len(R) if index is None else pixels_in_boxes(loc, R, sizes, index)
+    return [[i, r, _pixel_neighbors(i, r, loc, R, s, sizes, try_hard, b)] 
+            for i, [r, s, b] in enumerate(izip(R, sizes, boxes))]
 
 
-def _pixel_neighbors3(i, r0, loc, R, size, sizes, try_hard):
+def _pixel_neighbors3(i, r0, loc, R, size, sizes, try_hard, boxes=None):
     n = []
-    dr = R-r0
-    for dx,dy in loc:
+    for d,[dx,dy] in enumerate(loc):
         l = complex(dx, dy)
-        r = dr-l*size
-        d = abs(r)
-        w = where((abs(r.real) < 0.5*size) * (abs(r.imag) < 0.5*size))[0]
+        w = _pixel_box(r0, l, R, size, None if boxes is None else boxes[d])
         if len(w) == 0:
             if try_hard: 
                 w = array([pixel_containing(r0+l*size, R, sizes)])
@@ -124,9 +215,10 @@ def _pixel_neighbors3(i, r0, loc, R, size, sizes, try_hard):
     return n
 
 
-def pixel_neighbors3(loc, R, sizes, try_hard=True):
-    return [[i, r, _pixel_neighbors3(i,r,loc,R,s, sizes, try_hard)]
-            for i, [r, s] in enumerate(izip(R, sizes))]
+def pixel_neighbors3(loc, R, sizes, try_hard=True, index=None):
+    boxes = [None]*len(R) if index is None else pixels_in_boxes(loc, R, sizes, index)
+    return [[i, r, _pixel_neighbors3(i,r,loc,R,s, sizes, try_hard, b)]
+            for i, [r, s, b] in enumerate(izip(R, sizes, boxes))]
 
 
 def xy_grid(L, S=1, scale=1):
@@ -353,38 +445,12 @@ def irrhistogram2d(R,C,rbin,binsize, weights=None):
 
     h = zeros(len(rbin))
 
-    # from scipy import weave
-    import weave
-    code="""
-        int i;
-        #ifdef WITH_OMP
-        omp_set_num_threads(threads);
-        #endif
-        #pragma omp parallel for
-        for (i=0; i < Nrbin[0]; i++)
-        {
-            long j;
-            const float left   = std::real(rbin[i]) - binsize[i]/2;
-            const float right  = std::real(rbin[i]) + binsize[i]/2;
-            const float top    = std::imag(rbin[i]) + binsize[i]/2;
-            const float bottom = std::imag(rbin[i]) - binsize[i]/2;
-            for (j=0; j < NR[0]; j++)
-            {
-                if (left <= C[j] && C[j] < right)
-                {
-                    if (bottom < R[j] && R[j] <= top)
-                    {
-                        h[i] += weights[j];
-                    }
-                }
-            }
-        }
-    """
-    nbins = len(rbin)
-    threads = Environment.global_opts['ncpus']
-    kw = Environment.global_opts['omp_opts']
-    C = np.array(C)
-    v = weave.inline(code, ['h', 'R', 'C', 'rbin','binsize', 'weights', 'threads'], **kw)
+    R       = np.ascontiguousarray(R, dtype=float)
+    C       = np.ascontiguousarray(C, dtype=float)
+    rbin    = np.ascontiguousarray(rbin, dtype=complex)
+    binsize = np.ascontiguousarray(binsize, dtype=float)
+    weights = np.ascontiguousarray(weights, dtype=float)
+    cpotential.irrhistogram2d(R, C, rbin, binsize, weights, h, Environment.global_opts['ncpus'])
 
     return h
     
@@ -449,24 +515,39 @@ class PixelBasis(object):
         self.symmetric = False
 
     def __getattr__(self, name):
-        if name == 'nbrs':
+        if name == 'pixel_index':
+            # States saved before the index existed build it on demand.
+            super(PixelBasis, self).__setattr__('pixel_index', PixelIndex(self.int_ploc, amin(self.int_cell_size)))
+            return self.pixel_index
+        elif name == 'ring_matrix':
+            # Row i holds the areas of the pixels on ring i, so that sums
+            # over the rings are a single product with a pixel vector.
+            r = np.concatenate(self.rings)
+            i = repeat(arange(len(self.rings)), [len(x) for x in self.rings])
+            super(PixelBasis, self).__setattr__('ring_matrix',
+                csr_matrix((self.cell_size[r]**2, (i, r)), shape=(len(self.rings), len(self.cell_size))))
+            return self.ring_matrix
+        elif name == 'ring_area':
+            super(PixelBasis, self).__setattr__('ring_area', asarray(self.ring_matrix.sum(axis=1)).ravel())
+            return self.ring_area
+        elif name == 'nbrs':
             Log( 'Finding neighbors...' )
             #super(PixelBasis, self).__setattr__('nbrs',  all_neighbors(self.int_ploc,            1.5 * self.int_cell_size))
             super(PixelBasis, self).__setattr__('nbrs', 
                 pixel_neighbors3([ [0,1], [1,0], [0,-1], [-1,0], [1,1], [-1,1], [1,-1], [-1,-1] ], 
-                                self.int_ploc, self.int_cell_size, try_hard=True))
+                                self.int_ploc, self.int_cell_size, try_hard=True, index=self.pixel_index))
             return self.nbrs
         elif name == 'nbrs2':
             Log( 'Finding neighbors 2...' )
             super(PixelBasis, self).__setattr__('nbrs2', 
-                pixel_neighbors([ [0,1], [1,0], [0,-1], [-1,0] ], self.int_ploc, self.int_cell_size, try_hard=True))
+                pixel_neighbors([ [0,1], [1,0], [0,-1], [-1,0] ], self.int_ploc, self.int_cell_size, try_hard=True, index=self.pixel_index))
 
             #super(PixelBasis, self).__setattr__('nbrs2', all_neighbors(self.int_ploc, self.grad_rmax * self.int_cell_size))
             return self.nbrs2
         elif name == 'nbrs3':
             Log( 'Finding neighbors 3...' )
             super(PixelBasis, self).__setattr__('nbrs3', 
-                pixel_neighbors3([ [0,1], [1,0], [0,-1], [-1,0] ], self.int_ploc, self.int_cell_size, try_hard=False))
+                pixel_neighbors3([ [0,1], [1,0], [0,-1], [-1,0] ], self.int_ploc, self.int_cell_size, try_hard=False, index=self.pixel_index))
 
             #super(PixelBasis, self).__setattr__('nbrs2', all_neighbors(self.int_ploc, self.grad_rmax * self.int_cell_size))
             #for i,n in enumerate(self.nbrs3): print i, n
@@ -488,6 +569,22 @@ class PixelBasis(object):
         else:
             raise AttributeError('Attribute %s not found in PixelBasis' % name)
 
+    def __getstate__(self):
+        # The deflection kernels are large and quick to rebuild.
+        state = self.__dict__.copy()
+        state.pop('defl_kernels', None)
+        return state
+
+    def neighbors_within(self, s):
+        """For each pixel, the other pixels within s [arcsec]. The lists are
+           cached for each s."""
+        if not hasattr(self, '_nbrs_within'):
+            super(PixelBasis, self).__setattr__('_nbrs_within', {})
+        if s not in self._nbrs_within:
+            self._nbrs_within[s] = [ n for _,_,n in 
+                all_neighbors(self.ploc, s, self.pixel_index, self.top_level_cell_size) ]
+        return self._nbrs_within[s]
+
     def init(self, obj):
         self.myobject = obj
 
@@ -604,6 +701,12 @@ class PixelBasis(object):
         rkeys          = rkeys.take(self.pmap)
         self.int_cell_size = self.int_cell_size.take(self.pmap)
 
+        #---------------------------------------------------------------------
+        # Index the pixels on a grid of the smallest cell size so that the
+        # neighbor lists and priors only look at nearby pixels.
+        #---------------------------------------------------------------------
+        self.pixel_index = PixelIndex(self.int_ploc, amin(self.int_cell_size))
+
         #---------------------------------------------------------------------
         # Make neighbor lists
         #---------------------------------------------------------------------
@@ -663,7 +766,9 @@ class PixelBasis(object):
             for p in r:
                 self.pixel_to_ring[p] = ri
 
-        self.oppose = [ argwhere(self.int_ploc == -l).ravel() for l in self.int_ploc ]
+        q, j = self.pixel_index.pairs(-self.int_ploc, 0)
+        k = self.int_ploc[j] == -self.int_ploc[q]
+        self.oppose = split_pairs(q[k], j[k], npix)
 
         # XXX: Need these for the annular density prior
         #inner_image_ring = rmin // self.cell_size
@@ -1149,12 +1254,96 @@ class PixelBasis(object):
 #                        s1*obj.shear.poten_ddy(theta) + s2*obj.shear.poten_dd2y(theta))
         return K
 
+    def _deflection_kernels(self):
+        """Fourier transforms of the kernels used by deflections(). Every
+           pixel center lies on a lattice whose spacing is the smallest cell
+           size, even in the hires region, so the deflection due to all the
+           pixels of one size is a convolution on that lattice. There is one
+           kernel per cell size. None if the pixels are not on a lattice."""
+
+        if hasattr(self, 'defl_kernels'):
+            return self.defl_kernels
+
+        h  = amin(self.int_cell_size)
+        ix = np.rint(self.int_ploc.real / h).astype(int)
+        iy = np.rint(self.int_ploc.imag / h).astype(int)
+
+        if not (np.allclose(ix*h, self.int_ploc.real, atol=1e-6*h) 
+           and  np.allclose(iy*h, self.int_ploc.imag, atol=1e-6*h)):
+            Log( 'Pixels are not on a lattice. Deflections will be summed directly.' )
+            super(PixelBasis, self).__setattr__('defl_kernels', None)
+            return None
+
+        #---------------------------------------------------------------------
+        # Zero padding to at least twice the lattice size turns the circular
+        # FFT convolution into a linear one. Offsets past the middle of the
+        # padded grid wrap around to negative ones.
+        #---------------------------------------------------------------------
+        col = ix - amin(ix)
+        row = iy - amin(iy)
+        nr,nc = amax(row)+1, amax(col)+1
+        shape = (fft_size(2*nr-1), fft_size(2*nc-1))
+
+        dc = arange(shape[1]); dc[dc > shape[1]//2] -= shape[1]
+        dr = arange(shape[0]); dr[dr > shape[0]//2] -= shape[0]
+        offs = (dc + 1j*atleast_2d(dr).T) * h * self.top_level_cell_size
+
+        kernels = []
+        for s in unique(self.int_cell_size):
+            a = s * self.top_level_cell_size
+            kernels.append([ self.int_cell_size == s, 
+                             np.fft.rfft2(poten_dx(offs, a, self.maprad)), 
+                             np.fft.rfft2(poten_dy(offs, a, self.maprad)) ])
+
+        super(PixelBasis, self).__setattr__('defl_kernels', [row, col, shape, kernels])
+        return self.defl_kernels
+
+    def deflections(self, kappa, chunk=16):
+        """The deflection at every pixel due to the mass in the pixels, as a
+           complex array, for one kappa (npix) or a set of them (n x npix).
+           On a pixel lattice this is an FFT convolution, O(N log N) per
+           model; otherwise the pixels are summed directly with grad()."""
+
+        kappa = atleast_2d(kappa)
+        defl  = empty(kappa.shape, dtype=complex)
+
+        K = self._deflection_kernels()
+        if K is None:
+            for d,k in izip(defl, kappa):
+                d[:] = grad(k, self.ploc, self.ploc, self.cell_size)
+            return defl
+
+        row, col, shape, kernels = K
+        for i in xrange(0, len(kappa), chunk):
+            k = kappa[i:i+chunk]
+            Dx = Dy = 0
+            for w,Kx,Ky in kernels:
+                g = zeros((len(k),) + shape)
+                g[:, row[w], col[w]] = k[:, w]
+                G = np.fft.rfft2(g)
+                Dx = Dx + G * Kx
+                Dy = Dy + G * Ky
+            defl[i:i+chunk].real = np.fft.irfft2(Dx, shape)[:, row, col]
+            defl[i:i+chunk].imag = np.fft.irfft2(Dy, shape)[:, row, col]
+
+        return defl
+
+    def extra_deflections(self, data):
+        """The deflection at every pixel due to the external potentials."""
+        obj  = self.myobject
+        defl = zeros(len(self.ploc), dtype=complex)
+        for e in obj.extra_potentials:
+            d = data[e.name] * (e.poten_dx(self.ploc) + 1j*e.poten_dy(self.ploc)).T
+            while len(d.shape) > 1:
+                d = sum(d, axis=-1)
+            defl += d
+        return defl
+
     def srcdiff(self, data, src_index):
         if not data.has_key('srcdiff'):
             obj = self.myobject
 
             kappa   = data['kappa']
-            deflect = empty_like(self.ploc)
             #dist    = empty_like(self.ploc)
             ploc    = self.ploc
             cell_size = self.cell_size
@@ -1167,39 +1356,7 @@ class PixelBasis(object):
 
 
             if not data.has_key('deflect'):
-                x = False
-                _or = None 
-                def pot_grad(args):
-#                   global x
-                    i,theta = args
-#                   if (i%100) == 0: 
-#                       print 'Calculating srcdiff: % 5i/%5i\r' % (i+1, len(ploc)),;sys.stdout.flush(),
-#                       x = True
-                    deflect[i] = grad(kappa,theta,ploc,cell_size)
-                    s = complex(0,0)
-                    for e in obj.extra_potentials:
-                        #s += complex(sum(data[e.name] * e.poten_dx(theta).T),
-                        #        sum(data[e.name] * e.poten_dy(theta).T))
-                        #deflect[i] += s
-                        deflect[i] += sum(data[e.name] * (e.poten_dx(theta) + 1j*e.poten_dy(theta)))
-#                   if obj.shear:
-#                       s1,s2 = data['shear']
-#                       s = complex(s1*shear.poten_dx(0,theta) + s2*shear.poten_dx(1,theta),
-#                                   s1*shear.poten_dy(0,theta) + s2*shear.poten_dy(1,theta))
-#                       deflect[i] += s
-
-                #parallel_map(pot_grad, enumerate(ploc), threads = 1, return_ = False)
-                #parallel_map(pot_grad, enumerate(ploc), threads = env().ncpus, return_ = False)
-                for i,theta in enumerate(ploc):
-                    pot_grad((i,theta))
-                    if i%100 == 0: 
-                        print 'Calculating srcdiff: % 5i/%5i\r' % (i+1, len(ploc)),;sys.stdout.flush(),
-                        x = True
-                        #print 'Calculating srcdiff: % 6i/%6i\r' % (i+1, len(ploc)), ' '*40,;sys.stdout.flush() 
-
-                if x: 
-                    print ' '*40, '\r',
-
+                deflect = self.deflections(kappa)[0] + self.extra_deflections(data)
                 data['deflect'] = deflect
     
             else:
@@ -0,0 +1,458 @@
+#include <Python.h>
+#include <numpy/arrayobject.h>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*==========================================================================*/
+/* Pixels are handled in blocks of PIX_BLOCK. Each (point, block) pair is   */
+/* one task and leaves its sums in its own slot, so the sums are added in   */
+/* the same order however many threads are used.                            */
+/*==========================================================================*/
+#define PIX_BLOCK 256
+
+typedef double dble_t __attribute__ ((aligned(8)));
+
+typedef struct
+{
+    long M, N;                  /* image positions, pixels */
+    long nblocks;
+    const dble_t * restrict pos;    /* M complex values */
+    const dble_t * restrict ploc;   /* N complex values */
+    const dble_t * restrict a;      /* N cell sizes */
+    const dble_t * restrict sm;     /* N weights */
+    dble_t * restrict dx;           /* M x N */
+    dble_t * restrict dy;           /* M x N */
+    dble_t * restrict pot;          /* M x N */
+    dble_t * restrict partial;      /* M x nblocks x 3 */
+} lens_rows_t;
+
+typedef struct
+{
+    long M, N;                  /* evaluation points, pixels */
+    long nblocks;
+    const dble_t * restrict r0;     /* M complex values */
+    const dble_t * restrict ploc;   /* N complex values */
+    const dble_t * restrict a;      /* N cell sizes */
+    const dble_t * restrict W;      /* N weights */
+    dble_t * restrict partial;      /* M x nblocks x 2 */
+} grad_t;
+
+typedef struct
+{
+    long nbins, N;
+    const dble_t * restrict R;      /* N values */
+    const dble_t * restrict C;      /* N values */
+    const dble_t * restrict rbin;   /* nbins complex values */
+    const dble_t * restrict binsize;
+    const dble_t * restrict weights;
+    dble_t * restrict h;
+} histogram_t;
+
+typedef void (*task_fn)(const void *job, long task);
+
+typedef struct
+{
+    task_fn fn;
+    const void *job;
+    long ntasks, first, stride;
+} task_thread_t;
+
+PyObject *cpotential_lens_rows(PyObject *self, PyObject *args);
+PyObject *cpotential_grad(PyObject *self, PyObject *args);
+PyObject *cpotential_irrhistogram2d(PyObject *self, PyObject *args);
+
+static PyMethodDef cpotential_methods[] =
+{
+    {"lens_rows", cpotential_lens_rows, METH_VARARGS, "lens_rows"},
+    {"grad", cpotential_grad, METH_VARARGS, "grad"},
+    {"irrhistogram2d", cpotential_irrhistogram2d, METH_VARARGS, "irrhistogram2d"},
+    {NULL, NULL, 0, NULL}
+};
+
+PyMODINIT_FUNC initcpotential()
+{
+    (void)Py_InitModule("cpotential", cpotential_methods);
+}
+
+/*==========================================================================*/
+/* Tasks 0..ntasks-1 are dealt out round-robin to nthreads threads. The     */
+/* calling thread takes the first share. Must be called without the GIL.    */
+/*==========================================================================*/
+static void *task_thread(void *arg)
+{
+    long t;
+    const task_thread_t *thr = (task_thread_t *)arg;
+
+    for (t=thr->first; t < thr->ntasks; t += thr->stride)
+        thr->fn(thr->job, t);
+
+    return NULL;
+}
+
+static void run_tasks(task_fn fn, const void *job, long ntasks, long nthreads)
+{
+    long k;
+
+    if (nthreads > ntasks) nthreads = ntasks;
+    if (nthreads < 1) nthreads = 1;
+
+    task_thread_t *tt      = (task_thread_t *)malloc(nthreads * sizeof(*tt));
+    pthread_t     *thr     = (pthread_t *)malloc(nthreads * sizeof(*thr));
+    int32_t       *started = (int32_t *)malloc(nthreads * sizeof(*started));
+
+    /*======================================================================*/
+    /* Without the bookkeeping arrays everything runs on the calling thread.*/
+    /*======================================================================*/
+    if (tt == NULL || thr == NULL || started == NULL)
+    {
+        task_thread_t one = {fn, job, ntasks, 0, 1};
+        task_thread(&one);
+        free(started);
+        free(thr);
+        free(tt);
+        return;
+    }
+
+    for (k=0; k < nthreads; k++)
+    {
+        tt[k].fn     = fn;
+        tt[k].job    = job;
+        tt[k].ntasks = ntasks;
+        tt[k].first  = k;
+        tt[k].stride = nthreads;
+    }
+
+    /*======================================================================*/
+    /* A share whose thread could not be started is run here instead. Each  */
+    /* task writes only its own slot, so the results are unchanged.         */
+    /*======================================================================*/
+    for (k=1; k < nthreads; k++)
+        started[k] = pthread_create(thr+k, NULL, task_thread, tt+k) == 0;
+    task_thread(tt);
+    for (k=1; k < nthreads; k++) if (!started[k]) task_thread(tt+k);
+    for (k=1; k < nthreads; k++) if (started[k]) pthread_join(thr[k], NULL);
+
+    free(started);
+    free(thr);
+    free(tt);
+}
+
+/*==========================================================================*/
+/* The potential of a uniform square pixel of side a at the offset (x,y),   */
+/* and its x and y derivatives. These are poten(), poten_dx() and           */
+/* poten_dy() from potential.py with the same operations in the same order; */
+/* the eight arctangents and four logarithms are shared by all three.       */
+/*==========================================================================*/
+static inline void pixel_potential(const double x, const double y, const double a,
+                                   double *vx, double *vy, double *vp)
+{
+    const double xm = x - a/2;
+    const double xp = x + a/2;
+    const double ym = y - a/2;
+    const double yp = y + a/2;
+
+    const double xm2 = xm*xm;
+    const double xp2 = xp*xp;
+    const double ym2 = ym*ym;
+    const double yp2 = yp*yp;
+
+    const double at_ym_xm = atan(ym/xm);
+    const double at_yp_xp = atan(yp/xp);
+    const double at_yp_xm = atan(yp/xm);
+    const double at_ym_xp = atan(ym/xp);
+    const double at_xm_ym = atan(xm/ym);
+    const double at_xp_yp = atan(xp/yp);
+    const double at_xp_ym = atan(xp/ym);
+    const double at_xm_yp = atan(xm/yp);
+
+    const double log_xm2_ym2 = log(xm2 + ym2);
+    const double log_xp2_yp2 = log(xp2 + yp2);
+    const double log_xp2_ym2 = log(xp2 + ym2);
+    const double log_xm2_yp2 = log(xm2 + yp2);
+
+    *vx = ((xm*at_ym_xm + xp*at_yp_xp) + (ym*log_xm2_ym2 + yp*log_xp2_yp2) / 2
+        - (xm*at_yp_xm + xp*at_ym_xp) - (ym*log_xp2_ym2 + yp*log_xm2_yp2) / 2) / M_PI;
+
+    *vy = (ym*at_xm_ym + yp*at_xp_yp
+        - ym*at_xp_ym - yp*at_xm_yp
+        + xm*log_xm2_ym2/2 + xp*log_xp2_yp2/2
+        - xm*log_xm2_yp2/2 - xp*log_xp2_ym2/2) / M_PI;
+
+    if (vp == NULL) return;
+
+    *vp = (-3 * (a*a)
+        + (xm2*at_ym_xm + ym2*at_xm_ym + xm*ym*log_xm2_ym2)
+        + (xp2*at_yp_xp + yp2*at_xp_yp + xp*yp*log_xp2_yp2)
+        - (xm2*at_yp_xm + yp2*at_xm_yp + xp*ym*log_xp2_ym2)
+        - (xp2*at_ym_xp + ym2*at_xp_ym + xm*yp*log_xm2_yp2)) / (2*M_PI);
+}
+
+static void lens_rows_task(const void *arg, long t)
+{
+    long n;
+    const lens_rows_t *job = (lens_rows_t *)arg;
+    const long m  = t / job->nblocks;
+    const long b  = t % job->nblocks;
+    const long N  = job->N;
+    const long n0 = b * PIX_BLOCK;
+    const long n1 = (n0 + PIX_BLOCK < N) ? n0 + PIX_BLOCK : N;
+
+    const double px = job->pos[2*m+0];
+    const double py = job->pos[2*m+1];
+
+    const dble_t * restrict ploc = job->ploc;
+    const dble_t * restrict a    = job->a;
+    const dble_t * restrict sm   = job->sm;
+    dble_t * restrict dx  = job->dx  + m*N;
+    dble_t * restrict dy  = job->dy  + m*N;
+    dble_t * restrict pot = job->pot + m*N;
+
+    double sx=0, sy=0, sp=0;
+
+    for (n=n0; n < n1; n++)
+    {
+        double vx, vy, vp;
+        pixel_potential(px - ploc[2*n+0], py - ploc[2*n+1], a[n], &vx, &vy, &vp);
+
+        dx[n]  = vx;
+        dy[n]  = vy;
+        pot[n] = vp;
+
+        sx += sm[n] * vx;
+        sy += sm[n] * vy;
+        sp += sm[n] * vp;
+    }
+
+    dble_t *s = job->partial + 3*t;
+    s[0] = sx;
+    s[1] = sy;
+    s[2] = sp;
+}
+
+static void grad_task(const void *arg, long t)
+{
+    long n;
+    const grad_t *job = (grad_t *)arg;
+    const long m  = t / job->nblocks;
+    const long b  = t % job->nblocks;
+    const long n0 = b * PIX_BLOCK;
+    const long n1 = (n0 + PIX_BLOCK < job->N) ? n0 + PIX_BLOCK : job->N;
+
+    const double px = job->r0[2*m+0];
+    const double py = job->r0[2*m+1];
+
+    const dble_t * restrict ploc = job->ploc;
+    const dble_t * restrict a    = job->a;
+    const dble_t * restrict W    = job->W;
+
+    double sx=0, sy=0;
+
+    for (n=n0; n < n1; n++)
+    {
+        double vx, vy;
+        pixel_potential(px - ploc[2*n+0], py - ploc[2*n+1], a[n], &vx, &vy, NULL);
+        sx += W[n] * vx;
+        sy += W[n] * vy;
+    }
+
+    job->partial[2*t+0] = sx;
+    job->partial[2*t+1] = sy;
+}
+
+/*==========================================================================*/
+/* Bin i is the square of side binsize[i] centered on rbin[i], with C along */
+/* the real axis and R along the imaginary axis. The bin edges are rounded  */
+/* to single precision, as they always have been.                           */
+/*==========================================================================*/
+static void histogram_task(const void *arg, long i)
+{
+    long j;
+    const histogram_t *job = (histogram_t *)arg;
+
+    const float left   = job->rbin[2*i+0] - job->binsize[i]/2;
+    const float right  = job->rbin[2*i+0] + job->binsize[i]/2;
+    const float top    = job->rbin[2*i+1] + job->binsize[i]/2;
+    const float bottom = job->rbin[2*i+1] - job->binsize[i]/2;
+
+    const dble_t * restrict R = job->R;
+    const dble_t * restrict C = job->C;
+    const dble_t * restrict weights = job->weights;
+
+    double h = 0;
+    for (j=0; j < job->N; j++)
+    {
+        if (left <= C[j] && C[j] < right)
+        {
+            if (bottom < R[j] && R[j] <= top)
+            {
+                h += weights[j];
+            }
+        }
+    }
+
+    job->h[i] = h;
+}
+
+/*==========================================================================*/
+/* lens_rows(pos, ploc, a, sm, dx, dy, pot, smsum, nthreads)                */
+/*                                                                          */
+/* For every image position pos[m] and pixel n, fill dx[m,n], dy[m,n] and   */
+/* pot[m,n] with the deflection and potential of pixel n at pos[m]. Row m   */
+/* of smsum receives the sums of those rows weighted by sm. All arrays must */
+/* be C contiguous; pos and ploc are complex, the rest double.              */
+/*==========================================================================*/
+PyObject *cpotential_lens_rows(PyObject *self, PyObject *args)
+{
+    long m, b;
+    long nthreads;
+    lens_rows_t job;
+
+    PyObject *po_pos, *po_ploc, *po_a, *po_sm;
+    PyObject *po_dx, *po_dy, *po_pot, *po_smsum;
+
+    if (!PyArg_ParseTuple(args, "OOOOOOOOl", &po_pos, &po_ploc, &po_a, &po_sm,
+                          &po_dx, &po_dy, &po_pot, &po_smsum, &nthreads))
+        return NULL;
+
+    job.M = PyArray_DIM(po_pos,0);
+    job.N = PyArray_DIM(po_ploc,0);
+    job.nblocks = (job.N + PIX_BLOCK - 1) / PIX_BLOCK;
+
+    assert(PyArray_DIM(po_a,0)  == job.N);
+    assert(PyArray_DIM(po_sm,0) == job.N);
+    assert(PyArray_DIM(po_dx,0) == job.M && PyArray_DIM(po_dx,1) == job.N);
+    assert(PyArray_DIM(po_dy,0) == job.M && PyArray_DIM(po_dy,1) == job.N);
+    assert(PyArray_DIM(po_pot,0) == job.M && PyArray_DIM(po_pot,1) == job.N);
+    assert(PyArray_DIM(po_smsum,0) == job.M && PyArray_DIM(po_smsum,1) == 3);
+
+    job.pos     = (dble_t *)PyArray_DATA(po_pos);
+    job.ploc    = (dble_t *)PyArray_DATA(po_ploc);
+    job.a       = (dble_t *)PyArray_DATA(po_a);
+    job.sm      = (dble_t *)PyArray_DATA(po_sm);
+    job.dx      = (dble_t *)PyArray_DATA(po_dx);
+    job.dy      = (dble_t *)PyArray_DATA(po_dy);
+    job.pot     = (dble_t *)PyArray_DATA(po_pot);
+    job.partial = (dble_t *)malloc(3 * job.M * job.nblocks * sizeof(dble_t));
+
+    Py_BEGIN_ALLOW_THREADS
+    run_tasks(lens_rows_task, &job, job.M * job.nblocks, nthreads);
+    Py_END_ALLOW_THREADS
+
+    dble_t *smsum = (dble_t *)PyArray_DATA(po_smsum);
+    for (m=0; m < job.M; m++)
+    {
+        smsum[3*m+0] = smsum[3*m+1] = smsum[3*m+2] = 0;
+        for (b=0; b < job.nblocks; b++)
+        {
+            const dble_t *s = job.partial + 3*(m*job.nblocks + b);
+            smsum[3*m+0] += s[0];
+            smsum[3*m+1] += s[1];
+            smsum[3*m+2] += s[2];
+        }
+    }
+
+    free(job.partial);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*==========================================================================*/
+/* grad(W, r0, ploc, a, out, nthreads)                                      */
+/*                                                                          */
+/* out[m] = sum_n W[n] * (poten_dx + i poten_dy)(r0[m] - ploc[n], a[n]),    */
+/* the deflection at each of the points r0 due to the pixels ploc with      */
+/* densities W. r0, ploc and out are complex, W and a double.              */
+/*==========================================================================*/
+PyObject *cpotential_grad(PyObject *self, PyObject *args)
+{
+    long m, b;
+    long nthreads;
+    grad_t job;
+
+    PyObject *po_W, *po_r0, *po_ploc, *po_a, *po_out;
+
+    if (!PyArg_ParseTuple(args, "OOOOOl", &po_W, &po_r0, &po_ploc, &po_a, &po_out, &nthreads))
+        return NULL;
+
+    job.M = PyArray_DIM(po_r0,0);
+    job.N = PyArray_DIM(po_ploc,0);
+    job.nblocks = (job.N + PIX_BLOCK - 1) / PIX_BLOCK;
+
+    assert(PyArray_DIM(po_W,0)   == job.N);
+    assert(PyArray_DIM(po_a,0)   == job.N);
+    assert(PyArray_DIM(po_out,0) == job.M);
+
+    job.W       = (dble_t *)PyArray_DATA(po_W);
+    job.r0      = (dble_t *)PyArray_DATA(po_r0);
+    job.ploc    = (dble_t *)PyArray_DATA(po_ploc);
+    job.a       = (dble_t *)PyArray_DATA(po_a);
+    job.partial = (dble_t *)malloc(2 * job.M * job.nblocks * sizeof(dble_t));
+
+    Py_BEGIN_ALLOW_THREADS
+    run_tasks(grad_task, &job, job.M * job.nblocks, nthreads);
+    Py_END_ALLOW_THREADS
+
+    dble_t *out = (dble_t *)PyArray_DATA(po_out);
+    for (m=0; m < job.M; m++)
+    {
+        out[2*m+0] = out[2*m+1] = 0;
+        for (b=0; b < job.nblocks; b++)
+        {
+            out[2*m+0] += job.partial[2*(m*job.nblocks + b)+0];
+            out[2*m+1] += job.partial[2*(m*job.nblocks + b)+1];
+        }
+    }
+
+    free(job.partial);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*==========================================================================*/
+/* irrhistogram2d(R, C, rbin, binsize, weights, h, nthreads)                */
+/*                                                                          */
+/* h[i] is the sum of the weights of the points (C[j], R[j]) that fall in   */
+/* bin i. rbin is complex, everything else double.                          */
+/*==========================================================================*/
+PyObject *cpotential_irrhistogram2d(PyObject *self, PyObject *args)
+{
+    long nthreads;
+    histogram_t job;
+
+    PyObject *po_R, *po_C, *po_rbin, *po_binsize, *po_weights, *po_h;
+
+    if (!PyArg_ParseTuple(args, "OOOOOOl", &po_R, &po_C, &po_rbin, &po_binsize, &po_weights, &po_h, &nthreads))
+        return NULL;
+
+    job.N     = PyArray_DIM(po_R,0);
+    job.nbins = PyArray_DIM(po_rbin,0);
+
+    assert(PyArray_DIM(po_C,0)       == job.N);
+    assert(PyArray_DIM(po_weights,0) == job.N);
+    assert(PyArray_DIM(po_binsize,0) == job.nbins);
+    assert(PyArray_DIM(po_h,0)       == job.nbins);
+
+    job.R       = (dble_t *)PyArray_DATA(po_R);
+    job.C       = (dble_t *)PyArray_DATA(po_C);
+    job.rbin    = (dble_t *)PyArray_DATA(po_rbin);
+    job.binsize = (dble_t *)PyArray_DATA(po_binsize);
+    job.weights = (dble_t *)PyArray_DATA(po_weights);
+    job.h       = (dble_t *)PyArray_DATA(po_h);
+
+    Py_BEGIN_ALLOW_THREADS
+    run_tasks(histogram_task, &job, job.nbins, nthreads);
+    Py_END_ALLOW_THREADS
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
@@ -18,11 +18,15 @@ class PixelLensModel(LensModel):
         LensModel.__init__(self, obj)
         #self.sol = sol
 
-    def mean_kappa(self,k,x):
-        if not isinstance(k, (type(0), type(0.0))):
-            return np.sum(k[x] * self.obj.basis.cell_size[x]**2) / np.sum(self.obj.basis.cell_size[x]**2)
-        else:
-            return k
+    def ring_sums(self, k):
+        """The area weighted sum of k over each ring."""
+        return self.obj.basis.ring_matrix.dot(k)
+
+    def mean_kappa(self, k):
+        """The area weighted mean of k on each ring."""
+        if isinstance(k, (type(0), type(0.0))):
+            return np.repeat(float(k), len(self.obj.basis.rings))
+        return self.ring_sums(k) / self.obj.basis.ring_area
 
     @prop('kappa star')
     def kappa_star(self):
@@ -36,28 +40,27 @@ class PixelLensModel(LensModel):
     @prop('kappa(R)')
     def kappa_R(self, component=[]):
         k = ' '.join(['kappa'] + component)
-        return DArray([self.mean_kappa(self[k],r) for r in self.obj.basis.rings],
+        return DArray(self.mean_kappa(self[k]),
                        r'$\langle\kappa(R)\rangle$', {'$\kappa$': [1, None]})
 
     @prop('M(<R)')
     def M_ltR(self, component=[]):
         k = ' '.join(['kappa'] + component)
         dscale1 = convert('kappa to Msun/arcsec^2', 1, self.obj.dL, self['nu'])
-        b = self.obj.basis
-        return DArray(np.cumsum([np.sum(self[k][r]*b.cell_size[r]**2)*dscale1 for r in b.rings]),
+        return DArray(np.cumsum(self.ring_sums(self[k]))*dscale1,
                       r'$M(<R)$', {'Msun': [1, r'$M_\odot$']})
 
     @prop('Sigma(R)')
     def Sigma_R(self, component=[]):
         k = ' '.join(['kappa'] + component)
         dscale2 = convert('kappa to Msun/kpc^2',    1, self.obj.dL, self['nu'])
-        return DArray([self.mean_kappa(self[k],r)*dscale2 for r in self.obj.basis.rings],
+        return DArray(self.mean_kappa(self[k])*dscale2,
                        r'$\Sigma$', {'Msun/kpc^2': [1, r'$M_\odot/\mathrm{kpc}^2$']})
     @prop('kappa(<R)')
     def kappa_ltR(self, component=[]):
         k = ' '.join(['kappa'] + component)
-        M = np.cumsum([np.sum(self[k][r]*self.obj.basis.cell_size[r]**2) for r in self.obj.basis.rings]) 
-        V = np.cumsum([np.sum(self.obj.basis.cell_size[r]**2) for r in self.obj.basis.rings])
+        M = np.cumsum(self.ring_sums(self[k]))
+        V = np.cumsum(self.obj.basis.ring_area)
         return DArray(M/V, r'$\kappa(<R)$', {'kappa': [1, None]})
 
     @prop('R')
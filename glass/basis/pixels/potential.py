@@ -1,8 +1,9 @@
 from __future__ import division
 # import numpy as np
-from numpy import arctan, log, vectorize, array, mat
+from numpy import arctan, log, vectorize, array, mat, empty, ones, ascontiguousarray, atleast_1d, isscalar
 from math import pi, sin, cos
 from glass.environment import Environment
+from . import cpotential
 
 
 @vectorize
@@ -68,44 +69,25 @@ def poten_dx(r, a, R):
     return v / pi
 
 
-def XXpoten_dx(r, a):
-    # from scipy import weave
-    import weave
-    from numpy import empty_like
+def lens_rows(pos, ploc, a, sm=0):
+    """The deflection and potential at each of the image positions pos due
+       to every pixel, computed together in one threaded pass. Returns
+       (dx, dy, pot, smsum), where the first three are arrays of shape
+       (len(pos), len(ploc)) equal to poten_dx(), poten_dy() and poten() of
+       pos[i]-ploc, and row i of smsum holds the sums of those rows weighted
+       by sm."""
+    pos  = ascontiguousarray(atleast_1d(pos), dtype=complex)
+    ploc = ascontiguousarray(ploc, dtype=complex)
+    a    = ascontiguousarray(a * ones(len(ploc)))
+    sm   = ascontiguousarray(sm * ones(len(ploc)))
 
-    if isinstance(r, complex):  # if type(r) == type(complex(0, 0)):
-        return XXpoten_dx
-
-    v = empty_like(r.real)
-    code = """
-        int i;
-        double vi, xi,yi;
-        std::complex<double> ri;
-        for (i=0; i < l; i++)
-        {
-            //ri = py_to_complex(PyList_GetItem(r.ptr(),i),"r");
-            xi = std::real(r[i]);
-            yi = std::imag(r[i]);
-
-            double xm = xi - a[i]/2;
-            double xp = xi + a[i]/2;
-            double ym = yi - a[i]/2;
-            double yp = yi + a[i]/2;
-
-            double xm2 = xm*xm;
-            double xp2 = xp*xp;
-            double ym2 = ym*ym;
-            double yp2 = yp*yp;
-            vi = ((xm*atan(ym/xm) + xp*atan(yp/xp)) + (ym*log(xm2 + ym2) + yp*log(xp2 + yp2)) / 2
-                - (xm*atan(yp/xm) + xp*atan(ym/xp)) - (ym*log(xp2 + ym2) + yp*log(xm2 + yp2)) / 2);
-            vi /= pi;
-            v[i] = vi;
-        }
-    """
-
-    l = len(r)
-    weave.inline(code, ['l', 'r', 'v', 'pi', 'a'])
-    return v
+    dx    = empty((len(pos), len(ploc)))
+    dy    = empty((len(pos), len(ploc)))
+    pot   = empty((len(pos), len(ploc)))
+    smsum = empty((len(pos), 3))
+
+    cpotential.lens_rows(pos, ploc, a, sm, dx, dy, pot, smsum, Environment.global_opts['ncpus'])
+    return dx, dy, pot, smsum
 
 
 # @vectorize
@@ -129,50 +111,6 @@ def poten_dy(r, a, R):
     return v / pi
 
 
-def XXpoten_dy(r, a):
-    # from scipy import weave
-    import weave
-    from numpy import empty_like
-
-    if isinstance(r, complex):  # if type(r) == type(complex(0, 0)):
-        return XXpoten_dx
-
-    v = empty_like(r.real)
-    code = """
-        int i;
-        double vi, xi,yi;
-        std::complex<double> ri;
-        for (i=0; i < l; i++)
-        {
-            //ri = py_to_complex(PyList_GetItem(r.ptr(),i),"r");
-            xi = std::real(r[i]);
-            yi = std::imag(r[i]);
-
-            double xm = xi - a[i]/2;
-            double xp = xi + a[i]/2;
-            double ym = yi - a[i]/2;
-            double yp = yi + a[i]/2;
-
-            double xm2 = xm*xm;
-            double xp2 = xp*xp;
-            double ym2 = ym*ym;
-            double yp2 = yp*yp;
-            //vi = ((xm*atan(ym/xm)+xp*atan(yp/xp)) + (ym*log(xm2 + ym2)+yp*log(xp2 + yp2)) / 2
-            //   -  (xm*atan(yp/xm)+xp*atan(ym/xp)) - (ym*log(xp2 + ym2)+yp*log(xm2 + yp2)) / 2);
-            vi = (ym*atan(xm/ym)    + yp*atan(xp/yp)
-               - ym*atan(xp/ym)    - yp*atan(xm/yp)
-               + xm*log(xm2 + ym2)/2 + xp*log(xp2 + yp2)/2
-               - xm*log(xm2 + yp2)/2 - xp*log(xp2 + ym2)/2);
-            vi /= pi;
-            v[i] = vi;
-        }
-    """
-
-    l = len(r)
-    weave.inline(code, ['l', 'r', 'v', 'pi', 'a'])
-    return v
-
-
 @vectorize
 def poten_dxdy(r, a):
     x, y = r.real, r.imag
@@ -322,63 +260,20 @@ def maginv_new5(r, a, c, s):
 
 
 def grad(W, r0, r, a):
-    # from scipy import weave
-    import weave
+    """The deflection at r0 due to the pixels at r with sizes a and
+       densities W. r0 may be a single position or an array of positions,
+       which are all evaluated in one call."""
 
     if isinstance(r, complex):  # if type(r) == type(complex(0, 0)):
         assert 0, "Shouldn't use potential.grad() for none array-based positions."
 
-    code = """
-        int i;
-        std::complex<double> v(0,0);
-        //Py_BEGIN_ALLOW_THREADS
-        double xx=0,yy=0;
-        #ifdef WITH_OMP
-        omp_set_num_threads(threads);
-        #endif
-        #pragma omp parallel for reduction(+:xx) reduction(+:yy)
-        for (i=0; i < l; i++)
-        {
-            double vx,vy;
-            std::complex<double> dr = r0-r[i];
-            const double xi = std::real(dr);
-            const double yi = std::imag(dr);
-
-            const double xm = xi - a[i]/2;
-            const double xp = xi + a[i]/2;
-            const double ym = yi - a[i]/2;
-            const double yp = yi + a[i]/2;
-
-            const double xm2 = xm*xm;
-            const double xp2 = xp*xp;
-            const double ym2 = ym*ym;
-            const double yp2 = yp*yp;
-
-            const double log_xm2_ym2 = log(xm2 + ym2);
-            const double log_xp2_yp2 = log(xp2 + yp2);
-            const double log_xp2_ym2 = log(xp2 + ym2);
-            const double log_xm2_yp2 = log(xm2 + yp2);
-
-            vx = (xm*atan(ym/xm) + xp*atan(yp/xp)) + (ym*log_xm2_ym2 + yp*log_xp2_yp2) / 2
-               - (xm*atan(yp/xm) + xp*atan(ym/xp)) - (ym*log_xp2_ym2 + yp*log_xm2_yp2) / 2;
-            vx /= pi;
-            vx *= W[i];
-
-            vy = (ym*atan(xm/ym) + yp*atan(xp/yp)) + (xm*log_xm2_ym2 + xp*log_xp2_yp2) / 2
-               - (ym*atan(xp/ym) + yp*atan(xm/yp)) - (xm*log_xm2_yp2 + xp*log_xp2_ym2) / 2;
-            vy /= pi;
-            vy *= W[i];
-            //v += std::complex<double>(vx,vy);
-            xx += vx;
-            yy += vy;
-        }
-
-        //Py_END_ALLOW_THREADS
-        return_val = std::complex<double>(xx,yy);
-    """
-
-    l = len(r)
-    threads = Environment.global_opts['ncpus']
-    kw = Environment.global_opts['omp_opts']
-    v = weave.inline(code, ['l', 'W', 'r0', 'r', 'pi', 'a', 'threads'], **kw)
-    return v
+    single = isscalar(r0)
+
+    r0  = ascontiguousarray(atleast_1d(r0), dtype=complex)
+    r   = ascontiguousarray(r, dtype=complex)
+    W   = ascontiguousarray(W, dtype=float)
+    a   = ascontiguousarray(a * ones(len(r)))
+    out = empty(len(r0), dtype=complex)
+
+    cpotential.grad(W, r0, r, a, out, Environment.global_opts['ncpus'])
+    return out[0] if single else out
@@ -7,8 +7,9 @@ if __name__ != '__main__':
     from itertools import izip
     from glass.log import log as Log
     from glass.scales import convert
+    from glass.solvers.sparse_row import SparseRow
     from . basis import neighbors, irrhistogram2d
-    from . potential import poten, poten_dx, poten_dy, poten_dxdx, poten_dydy, maginv, maginv_new, poten_dxdy, maginv_new4, maginv_new5
+    from . potential import lens_rows, poten, poten_dx, poten_dy, poten_dxdx, poten_dydy, maginv, maginv_new, poten_dxdy, maginv_new4, maginv_new5
 else:
     def command(x): pass
 
@@ -150,23 +151,29 @@ def lens_eq(o, leq, eq, geq):
 
     stellar_mass = find_stellar_mass(o)
 
+    #-------------------------------------------------------------------------
+    # The deflection at every image of every source, and its stellar mass
+    # contribution, is computed at once.
+    #-------------------------------------------------------------------------
+    pos = [img.pos for src in o.sources for img in src.images]
+    dx,dy,_,smsum = lens_rows(pos, b.ploc, b.cell_size, stellar_mass)
 
+    k = 0
     for i,src in enumerate(o.sources):
         for j,img in enumerate(src.images):
             rows = new_row(o, 2)
             Log( 2*indent+"Source %i,Image %i: (% 8.4f, % 8.4f)" % (i,j,img.pos.real, img.pos.imag) ) #, b.cell_size
             rows[0,0] = (img.pos.real + b.map_shift) * src.zcap
             rows[1,0] = (img.pos.imag + b.map_shift) * src.zcap
-            positions = img.pos - b.ploc
-            rows[0,pix_start:pix_end] = -poten_dx(positions, b.cell_size, o.basis.maprad)
-            rows[1,pix_start:pix_end] = -poten_dy(positions, b.cell_size, o.basis.maprad)
+            rows[0,pix_start:pix_end] = -dx[k]
+            rows[1,pix_start:pix_end] = -dy[k]
 
             srcpos = srcpos_start + 2*i
             rows[0,srcpos:srcpos+2] = -1,  0
             rows[1,srcpos:srcpos+2] =  0, -1
 
-            sm_x = np.sum(poten_dx(positions, b.cell_size, o.basis.maprad) * stellar_mass)
-            sm_y = np.sum(poten_dy(positions, b.cell_size, o.basis.maprad) * stellar_mass)
+            sm_x, sm_y = smsum[k,0], smsum[k,1]
+            k += 1
 
             if o.stellar_mass_error != 0:
                 rows[0,sm_err] = -sm_x
@@ -260,6 +267,7 @@ def time_delay(o, leq, eq, geq):
 
     pix_start,    pix_end    = 1+b.offs_pix
     srcpos_start, srcpos_end = 1+b.offs_srcpos
+    sm_err = 1+b.offs_sm_err
 
     zLp1 = (1 + o.z) * o.dL
 
@@ -267,9 +275,25 @@ def time_delay(o, leq, eq, geq):
 
     stellar_mass = find_stellar_mass(o)
 
+    #-------------------------------------------------------------------------
+    # Potentials at every image that appears in a time delay, computed once
+    # even when an image is shared by several delays.
+    #-------------------------------------------------------------------------
+    imgs = {}
+    for src in o.sources:
+        for img0,img1,_ in src.time_delays:
+            imgs.setdefault(id(img0), [len(imgs), img0])
+            imgs.setdefault(id(img1), [len(imgs), img1])
+    pos = [img.pos for _,img in sorted(imgs.values())]
+    if pos:
+        _,_,pot,smsum = lens_rows(pos, b.ploc, b.cell_size, stellar_mass)
+
     for i, src in enumerate(o.sources):
         for img0,img1,delay in src.time_delays:
 
+            k0 = imgs[id(img0)][0]
+            k1 = imgs[id(img1)][0]
+
             delay = [d / zLp1 if d else d for d in delay]
 
             row = new_row(o)
@@ -294,16 +318,15 @@ def time_delay(o, leq, eq, geq):
 #           row[0] -= dot([x0-x1, y0-y1], shft)
 
             # The ln terms
-            row[pix_start:pix_end] -= poten(img1.pos - o.basis.ploc, b.cell_size, o.basis.maprad)
-            row[pix_start:pix_end] += poten(img0.pos - o.basis.ploc, b.cell_size, o.basis.maprad)
+            row[pix_start:pix_end] -= pot[k1]
+            row[pix_start:pix_end] += pot[k0]
 
-            sm = stellar_mass
+            sm_dpot = smsum[k1,2] - smsum[k0,2]
 
             if o.stellar_mass_error != 0:
-                sm = sm * sol[sm_err] # don't modified the original array with *=
-
-            row[0] -= sum(sm * poten(img1.pos - o.basis.ploc, b.cell_size, o.basis.maprad))
-            row[0] += sum(sm * poten(img0.pos - o.basis.ploc, b.cell_size, o.basis.maprad))
+                row[sm_err] = -sm_dpot
+            else:
+                row[0] -= sm_dpot
 
             for e,[start,end] in izip(o.extra_potentials, b.extra_potentials_array_offsets):
                 start += 1
@@ -1755,11 +1778,13 @@ def smoothness(o, leq, eq, geq):
     Log( indent + "Smoothness (factor=%.1f L=%.1f include_central_pixel=%s)" % (smoothness_factor, L, include_central_pixel) )
     Log( indent + "Smoothness factor decreases with radius" )
 
+    nbrs_L = o.basis.neighbors_within(L)
+
     c=0
     for i,[ri,r] in enumerate(izip(o.basis.int_ploc, o.basis.ploc)):
         if not include_central_pixel and i == o.basis.central_pixel: continue
 
-        nbrs = neighbors(r,L, o.basis.ploc)
+        nbrs = nbrs_L[i]
 
         row = new_row(o)
         row[pix_start + nbrs] = 1
@@ -1779,9 +1804,7 @@ def shared_h(objs, nvars, leq, eq, geq):
     for o1,o2 in izip(objs[:-1], objs[1:]):
         offs1 = o1.basis.array_offset
         offs2 = o2.basis.array_offset
-        row = zeros(1+nvars)
-        row[offs1 + o1.basis.H0] =  1
-        row[offs2 + o2.basis.H0] = -1
+        row = SparseRow(1+nvars, [offs1 + o1.basis.H0, offs2 + o2.basis.H0], [1, -1])
         eq(row) 
         on = True
 
@@ -0,0 +1,118 @@
+from __future__ import division
+import numpy as np
+
+from glass.scales import convert
+
+#===============================================================================
+# Ensemble reductions.
+#
+# Quantities of one object are stacked over all models into (nmodels x ...)
+# arrays. The values the models store themselves (kappa DM, nu, ...) are
+# stacked once, and the derived lens model properties are then computed for
+# the whole ensemble at once, so that a profile is a single sparse-dense
+# product with the basis' ring matrix rather than a property evaluation per
+# model. Anything else is stacked from the models' data dictionaries.
+#===============================================================================
+
+class Ensemble:
+
+    def __init__(self, models, obj_index=0):
+        self.models    = models
+        self.obj_index = obj_index
+        self.data      = [ m['obj,data'][obj_index][1] for m in models ]
+        self.obj       = models[0]['obj,data'][obj_index][0] if models else None
+        self._cache    = {}
+
+    def __len__(self):
+        return len(self.models)
+
+    def _stored(self, key):
+        """True if any model stores key itself rather than deriving it."""
+        return any(dict.__contains__(d, key) for d in self.data)
+
+    def _ring_basis(self):
+        return self.obj is not None and hasattr(self.obj, 'basis') and hasattr(self.obj.basis, 'rings')
+
+    def stack(self, key):
+        """data[key] of every model as one array."""
+        v = []
+        for d in self.data:
+            x = d[key]
+            if x is None: raise KeyError(key)
+            v.append(x)
+        return np.array(v)
+
+    def _get(self, key):
+        if key in self._cache:
+            return self._cache[key]
+
+        f = None if self._stored(key) or not self._ring_basis() else _derived.get(key, None)
+        v = f(self) if f is not None else self.stack(key)
+        self._cache[key] = v
+        return v
+
+    def get(self, key, units=None):
+        """data[key][units] of every model as one (nmodels x ...) array."""
+        v = self._get(key)
+        if units is None: return v
+
+        scale = _scales.get((key, units), None)
+        if scale is not None and not self._stored(key) and self._ring_basis():
+            s = np.asarray(scale(self))
+            return v * s.reshape(s.shape + (1,) * (v.ndim - s.ndim))
+
+        return np.array([ d[key][units] for d in self.data ])
+
+    #---------------------------------------------------------------------------
+    # Quantities derived from the stacked models.
+    #---------------------------------------------------------------------------
+
+    def kappa(self):
+        k = self.get('kappa DM')
+        stellar_mass = self.obj.stellar_mass if hasattr(self.obj, 'stellar_mass') else 0
+        ks = np.multiply.outer(self.get('sm_error_factor'), stellar_mass)
+        return k + (ks[:,None] if ks.ndim == 1 else ks)
+
+    def ring_sums(self, k):
+        """Area weighted sums of the rows of k over each ring."""
+        return self.obj.basis.ring_matrix.dot(k.T).T
+
+    def kappa_R(self):
+        return self.ring_sums(self.get('kappa')) / self.obj.basis.ring_area
+
+    def M_ltR(self):
+        dscale1 = convert('kappa to Msun/arcsec^2', 1, self.obj.dL, self.get('nu'))
+        return np.cumsum(self.ring_sums(self.get('kappa')), axis=1) * np.atleast_1d(dscale1)[:,None]
+
+    def Sigma_R(self):
+        dscale2 = convert('kappa to Msun/kpc^2', 1, self.obj.dL, self.get('nu'))
+        return self.get('kappa(R)') * np.atleast_1d(dscale2)[:,None]
+
+    def kappa_ltR(self):
+        M = np.cumsum(self.ring_sums(self.get('kappa')), axis=1)
+        return M / np.cumsum(self.obj.basis.ring_area)
+
+    def R(self):
+        b = self.obj.basis
+        return np.repeat(np.atleast_2d(b.rs + b.radial_cell_size / 2), len(self), axis=0)
+
+_derived = {
+    'kappa':        Ensemble.kappa,
+    'kappa(R)':     Ensemble.kappa_R,
+    'M(<R)':        Ensemble.M_ltR,
+    'Sigma(R)':     Ensemble.Sigma_R,
+    'kappa(<R)':    Ensemble.kappa_ltR,
+    'R':            Ensemble.R,
+    'H0':           lambda e: convert('nu to H0 in km/s/Mpc', e.get('nu')),
+    '1/H0':         lambda e: convert('nu to H0^-1 in Gyr',   e.get('nu')),
+}
+
+# Unit conversions of the derived quantities, as per-model scale factors.
+_scales = {
+    ('R', 'arcsec'):            lambda e: 1,
+    ('R', 'kpc'):               lambda e: convert('arcsec to kpc', 1, e.obj.dL, e.get('nu')),
+    ('kappa(R)', '$\kappa$'):   lambda e: 1,
+    ('M(<R)', 'Msun'):          lambda e: 1,
+    ('Sigma(R)', 'Msun/kpc^2'): lambda e: 1,
+    ('kappa(<R)', 'kappa'):     lambda e: 1,
+}
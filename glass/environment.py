@@ -120,6 +120,8 @@ class Environment:
         self.model_gen_factory = None #model_generator
         self.model_gen = None
         self.model_gen_options = {}
+        self.model_sink_options = None
+        self.post_process_pool = None
         self.solutions = None
         self.models = None
         self.accepted_models = None
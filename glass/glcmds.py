@@ -1,4 +1,5 @@
 from __future__ import division, with_statement, absolute_import
+import os
 import time
 import numpy as np
 from numpy import arctan2, savez, load, array, pi
@@ -14,6 +15,10 @@ from glass.scales import convert
 from glass.log import log as Log, setup_log
 from glass.exceptions import GLInputError
 from glass.utils import dist_range
+from glass.statefile import StateFile, is_statefile, save as save_statefile
+from glass.modelsink import ModelSink
+from glass.ensemble import Ensemble
+import glass.postprocess as postprocess
 
 @command
 def ptmass(xc, yc, mmin, mmax): raise GLInputError("ptmass not supported. Use external_mass().")
@@ -195,9 +200,7 @@ def savestate(env, fname):
     #env.post_process_funcs = []
     #env.post_filter_funcs = []
 
-    import numpy as np
-    with open(fname, 'w') as f:
-        savez(f, env)
+    save_statefile(env, fname)
 
     #env.post_process_funcs = ppf
     #env.post_filter_funcs = pff
@@ -207,8 +210,14 @@ def loadstate(env, fname, setenv=True):
     """ Load the state stored in fname and replace the current environment. If
     setenv is False the environment will not be replaced. Return the loaded
     environment.  
+
+    State files in the columnar format are memory mapped and the model data
+    are views into the file. The older pickled savez format is still read.
     """
-    x = load(fname, allow_pickle=True)['arr_0'].item()
+    if is_statefile(fname):
+        x = StateFile(fname).environment()
+    else:
+        x = load(fname, allow_pickle=True)['arr_0'].item()
     for o in x.objects:
         for i,s in enumerate(o.sources):
             if not hasattr(s,'index'):
@@ -217,6 +226,13 @@ def loadstate(env, fname, setenv=True):
     #if setenv: set_env(x)
     return x
 
+@command
+def statefile(env, fname):
+    """ Open the columnar state file fname without loading the models. Single
+    columns, such as '0/nu' for the first object, can then be read cheaply.
+    """
+    return StateFile(fname)
+
 @command
 def post_process(env, f, *args, **kwargs):
     env.current_object().post_process_funcs.append([f, args, kwargs])
@@ -225,11 +241,13 @@ def post_process(env, f, *args, **kwargs):
 def post_filter(env, f, *args, **kwargs):
     env.current_object().post_filter_funcs.append([f, args, kwargs])
 
-def _filter(models):
+def _filter(models, env=None):
     for m in models: m['accepted'] = False           # Reject all
-    models = filter(_filter_one, izip(models, count(), repeat(len(models))))      # Run each filter, keeping those that survive
-    #models = filter(parallel_map(_filter, models, threads=10))                 # Run each filter, keeping those that survive
-    for m,_,_ in models: m['accepted'] = True            # Those that make it to the end are accepted
+    nmodels = len(models)
+    if any(o.post_filter_funcs for m in models[:1] for o,_ in m['obj,data']):
+        keep = postprocess.run(models, lambda m,i: _filter_one((m,i,nmodels)), **_pool_options(env))     # Run each filter
+        models = [ m for m,k in izip(models, keep) if k ]                                               # keeping those that survive
+    for m in models: m['accepted'] = True            # Those that make it to the end are accepted
     return models
 
 def _filter_one(arg):
@@ -243,10 +261,59 @@ def _filter_one(arg):
 
 @command
 def apply_filters(env):
-    env.accepted_models = _filter(env.models)
+    env.accepted_models = _filter(env.models, env)
+
+@command
+def post_process_pool(env, mode='processes', nworkers=None, chunksize=16):
+    """ How post processing and post filter functions are run over the models.
+    mode is one of 'serial', 'threads' or 'processes'. nworkers defaults to
+    the number of cpus given on the command line. Models are handed out in
+    chunks of chunksize and results are always applied in model order.
+    Without a call to post_process_pool() everything runs serially.
+    """
+    assert mode in postprocess.MODES, 'Unknown post-processing mode %s' % mode
+    env.post_process_pool = {'mode': mode, 'nworkers': nworkers, 'chunksize': chunksize}
+
+def _pool_options(env):
+    opts = getattr(env, 'post_process_pool', None) if env is not None else None
+    if opts is None: return {'mode': 'serial'}
+    opts = dict(opts)
+    if opts.get('nworkers', None) is None:
+        opts['nworkers'] = Environment.global_opts.get('ncpus', 1)
+    return opts
+
+@command
+def model_sink(env, fname=None, buffer=64, sync_interval=10):
+    """ Stream the solutions from model() to fname as they are generated. At
+    most buffer solutions are kept before being written and the file is synced
+    every sync_interval seconds. The default file name is taken from the input
+    file. An interrupted run can be continued with model(n, resume=True).
+    """
+    env.model_sink_options = {'fname': fname, 'buffer': buffer, 'sync_interval': sync_interval}
+
+def _model_sink(env, resume):
+    opts = getattr(env, 'model_sink_options', None)
+    if opts is None:
+        if not resume: return None
+        opts = {}
+    opts = dict(opts)
+
+    if opts.get('fname') is None:
+        argv = Environment.global_opts.get('argv', [])
+        base = os.path.splitext(os.path.basename(argv[0]))[0] if argv else 'glass'
+        opts['fname'] = base + '.sink'
+
+    return ModelSink(**opts)
 
 @command
 def model(env, nmodels=None, *args, **kwargs):
+    """ Generate nmodels models. If a model sink is set, or resume is True,
+    solutions are streamed to disk as they are generated. With resume=True
+    the solutions already in the sink are reused and only the remainder are
+    generated, with a new random seed.
+    """
+
+    resume = kwargs.pop('resume', False)
 
     Log( '=' * 80 )
     Log('GLASS version 0.1  %s' % time.asctime())
@@ -272,23 +339,52 @@ def model(env, nmodels=None, *args, **kwargs):
              'tagged':  False}
         models.append(m)
     else:
-        for i,m in enumerate(generate_models(env.objects, nmodels, *args, **kwargs)):
-            Log( 'Model %i/%i complete.' % (i+1, nmodels), overwritable=True)
-            models.append(m)
-            solutions.append(m['sol'])
-            #print 'glcmds.py:model ???', id(m['sol'])
+        sink = _model_sink(env, resume)
+
+        resumed = []
+        if sink is not None and resume:
+            resumed = list(sink.resume())[:nmodels]
+            Log( 'Resuming with %i model(s) from %s.' % (len(resumed), sink.fname) )
+
+        seed = env.model_gen_options.get('rngseed', None)
+        if sink is not None and sink.next_seed() is not None:
+            env.model_gen_options['rngseed'] = sink.next_seed()
+
+        try:
+            nremaining = max(0, nmodels - len(resumed))
+            if nremaining:
+                for i,m in enumerate(generate_models(env.objects, nremaining, *args, **kwargs)):
+                    if sink is not None:
+                        if i == 0: sink.begin_segment(getattr(env.model_gen, 'random_seed', None))
+                        sink.append(m['sol'])
+                    Log( 'Model %i/%i complete.' % (len(resumed)+i+1, nmodels), overwritable=True)
+                    models.append(m)
+                    solutions.append(m['sol'])
+                    #print 'glcmds.py:model ???', id(m['sol'])
+            elif resumed:
+                init_model_generator(len(resumed))
+        finally:
+            if sink is not None: sink.close()
+            if seed is None: env.model_gen_options.pop('rngseed', None)
+            else:            env.model_gen_options['rngseed'] = seed
+
+        resumed_models = [package_solution(sol, env.objects) for sol in resumed]
+        for m in resumed_models:
+            check_model(env.objects, m)
+        models[:0]    = resumed_models
+        solutions[:0] = resumed
 
         Log( 'Generated %i model(s).' % len(models) )
-        _post_process(models)
+        _post_process(models, env)
 
     env.models.extend(models)
     env.solutions.extend(solutions)
-    env.accepted_models = _filter(env.models)
+    env.accepted_models = _filter(env.models, env)
 
-def _post_process(models):
+def _post_process(models, env=None):
     nmodels = len(models)
-    nProcessed = 0
-    for i,m in enumerate(models):
+
+    def process_one(m, i):
         has_ppfs = False
         for o,data in m['obj,data']:
             if o.post_process_funcs:
@@ -296,7 +392,11 @@ def _post_process(models):
                 #print 'Post processing ... Model %i/%i Object %s' % (i+1, nmodels, o.name)
                 for f,args,kwargs in o.post_process_funcs:
                     f((o,data), *args, **kwargs)
-        nProcessed += has_ppfs
+        return has_ppfs
+
+    nProcessed = 0
+    if any(o.post_process_funcs for m in models[:1] for o,_ in m['obj,data']):
+        nProcessed = sum(postprocess.run(models, process_one, **_pool_options(env)))
     Log('Post processed %i model(s), %i had post processing functions applied.' % (nmodels, nProcessed) )
 
 @command
@@ -326,10 +426,9 @@ def reprocess(env, state_file):
     #init_model_generator(len(env.solutions))
 
     env.models = [ m for m in regenerate_models(env.objects) ]
-    _post_process()
+    _post_process(env.models, env)
 
-    #env.models = parallel_map(_f, regenerate_models(env.objects), threads=10)
-    env.accepted_models = _filter(env.models)
+    env.accepted_models = _filter(env.models, env)
 
 def XXXreprocess(state_file):
     for o in env.objects:
@@ -354,13 +453,12 @@ def XXXreprocess(state_file):
 @command
 def ensemble_mass_rms(env, models, model0):
     total_rms2 = 0
-    for m in models:
-        for m1,m2 in izip(m['obj,data'], model0['obj,data']):
-            obj,data = m1
-            obj0,data0 = m2
-            mass0 = data0['kappa'] * convert('kappa to Msun/arcsec^2', 1, obj0.dL, data0['nu'])
-            mass1 = data['kappa'] * convert('kappa to Msun/arcsec^2', 1, obj.dL, data['nu'])
-            total_rms2 += np.mean((mass1 - mass0)**2)
+    for i,[obj0,data0] in enumerate(model0['obj,data']):
+        ens = Ensemble(models, i)
+        if not len(ens): break
+        mass0 = data0['kappa'] * convert('kappa to Msun/arcsec^2', 1, obj0.dL, data0['nu'])
+        mass1 = ens.get('kappa') * convert('kappa to Msun/arcsec^2', 1, ens.obj.dL, ens.get('nu'))[:,None]
+        total_rms2 += np.sum(np.mean((mass1 - mass0)**2, axis=1))
     return np.sqrt(total_rms2)
 
 
@@ -380,36 +478,23 @@ def ensemble_mass_rms(env, models, model0):
 
 @command
 def kappa_chi2(env, models, model0, frac='1sigma'):
-    n_max,d_max=0,0
-    n_min,d_min=np.inf,np.inf
-    ns, ds = [], []
-    for m in models:
-        n,d = 0,0
-        for m1,m2 in izip(m['obj,data'], model0['obj,data']):
-            obj,data = m1
-            obj0,data0 = m2
-            rs = [ abs(img.pos) for src in obj.sources for img in src.images if img.parity_name != 'max']
-            rmin, rmax = np.amin(rs), np.amax(rs)
-
-            #w = (abs(obj.basis.rs) >= rmin) * (abs(obj.basis.rs) <= rmax)
-            #w = abs(obj.basis.rs) <= rmax
-            w = (abs(obj.basis.ploc) >= obj.basis.top_level_cell_size * 0.9) * (abs(obj.basis.ploc) <= (rmax+ obj.basis.top_level_cell_size * 0.5))
-
-            #b = np.argmin(abs(data['R'] - rmin))
-            #e = np.argmin(abs(data['R'] - rmax))
-            #v0 = data0['kappa'][b:e+1]
-            #v1 = data['kappa'][b:e+1]
-
-            v0 = data0['kappa'][w]
-            v1 = data['kappa'][w]
-            n += np.sum((v1 - v0)**2)
-            d += np.sum(v0**2)
-        ns.append(n)
-        ds.append(d)
-
-        #n_max,d_max = np.amax([n,n_max]), np.amax([d,d_max])
-        #n_min,d_min = np.amin([n,n_min]), np.amin([d,d_min])
-    nd = array(ns) / array(ds)
+    ns, ds = 0, 0
+    for i,[obj0,data0] in enumerate(model0['obj,data']):
+        ens = Ensemble(models, i)
+        obj = ens.obj
+        rs = [ abs(img.pos) for src in obj.sources for img in src.images if img.parity_name != 'max']
+        rmin, rmax = np.amin(rs), np.amax(rs)
+
+        #w = (abs(obj.basis.rs) >= rmin) * (abs(obj.basis.rs) <= rmax)
+        #w = abs(obj.basis.rs) <= rmax
+        w = (abs(obj.basis.ploc) >= obj.basis.top_level_cell_size * 0.9) * (abs(obj.basis.ploc) <= (rmax+ obj.basis.top_level_cell_size * 0.5))
+
+        v0 = data0['kappa'][w]
+        dv = ens.get('kappa')[:,w] - v0
+        ns = ns + np.einsum('ij,ij->i', dv, dv)
+        ds = ds + np.dot(v0, v0)
+
+    nd = ns / ds
     return dist_range(nd, frac)
 #   nd.sort()
 #   N = len(nd)
@@ -426,34 +511,29 @@ def kappa_chi2(env, models, model0, frac='1sigma'):
 
 @command
 def kappa_profile_chi2(env, models, model0, frac='1sigma'):
-    n_max,d_max=0,0
-    n_min,d_min=np.inf,np.inf
-    ns, ds = [], []
-    for m in models:
-        n,d = 0,0
-        for m1,m2 in izip(m['obj,data'], model0['obj,data']):
-            obj,data = m1
-            obj0,data0 = m2
-            rs = [ abs(img.pos) for src in obj.sources for img in src.images]
-            #rs = [ abs(img.pos) for src in obj.sources for img in src.images if img.parity_name != 'max']
-            rmin, rmax = np.amin(rs), np.amax(rs)
-            if 0:
-                b = 0
-            else:
-                rmin = obj.basis.top_level_cell_size * 1.6
-                b = np.argmin(abs(data['R'] - rmin))
-
-            e = np.argmin(abs(data['R'] - rmax))
-
-            v0 = data0['kappa(R)'][b:e+1]
-            v1 = data['kappa(R)'][b:e+1]
-            n += np.sum((v1 - v0)**2)
-            d += np.sum(v0**2)
-            #d += len(v0) #np.sum(v0**2)
-        ns.append(n)
-        ds.append(d)
-
-    nd = array(ns) / array(ds)
+    ns, ds = 0, 0
+    for i,[obj0,data0] in enumerate(model0['obj,data']):
+        ens = Ensemble(models, i)
+        obj = ens.obj
+        rs = [ abs(img.pos) for src in obj.sources for img in src.images]
+        #rs = [ abs(img.pos) for src in obj.sources for img in src.images if img.parity_name != 'max']
+        rmin, rmax = np.amin(rs), np.amax(rs)
+        R = ens.get('R')[0]
+        if 0:
+            b = 0
+        else:
+            rmin = obj.basis.top_level_cell_size * 1.6
+            b = np.argmin(abs(R - rmin))
+
+        e = np.argmin(abs(R - rmax))
+
+        v0 = data0['kappa(R)'][b:e+1]
+        dv = ens.get('kappa(R)')[:,b:e+1] - v0
+        ns = ns + np.einsum('ij,ij->i', dv, dv)
+        ds = ds + np.dot(v0, v0)
+        #d += len(v0) #np.sum(v0**2)
+
+    nd = ns / ds
     return dist_range(nd, frac)
 #   nd.sort()
 #   N = len(nd)
@@ -4,36 +4,90 @@ def prop(name):
         return func
     return w
 
+def _props(cls):
+    """The derived properties of cls and its bases, by name. This is built
+    once per class."""
+    p = cls.__dict__.get('_lens_model_props', None)
+    if p is None:
+        p = {}
+        for c in reversed(cls.__mro__):
+            for f in c.__dict__.itervalues():
+                name = getattr(f, 'lens_model_prop_name', None)
+                if name is not None: p[name] = f
+        cls._lens_model_props = p
+    return p
+
 class LensModel(dict):
+    """A model's data. Items that are not stored are computed by the property
+    registered under that name, optionally followed by a component, as in
+    'kappa(R) DM'. Computed values are cached. The cache remembers which items
+    each value read, and setting or deleting an item drops every cached value
+    that depended on it."""
+
     def __init__(self, obj):
         dict.__init__(self)
         self.obj = obj
 
+    def __getstate__(self):
+        state = self.__dict__.copy()
+        state.pop('_prop_cache', None)
+        return state
+
+    def __setstate__(self, state):
+        self.__dict__.update(state)
+
+    def _cache(self):
+        c = self.__dict__.get('_prop_cache', None)
+        if c is None:
+            # values, the items each value read, and the items being computed
+            c = self.__dict__['_prop_cache'] = [{}, {}, []]
+        return c
+
+    def _invalidate(self, item):
+        values, deps, _ = self._cache()
+        for k,d in deps.items():
+            if item in d and k in deps:
+                del values[k], deps[k]
+                self._invalidate(k)
+
+    def __setitem__(self, item, value):
+        dict.__setitem__(self, item, value)
+        self._invalidate(item)
+
+    def __delitem__(self, item):
+        dict.__delitem__(self, item)
+        self._invalidate(item)
+
     def __getitem__(self, item):
+        values, deps, computing = self._cache()
+        if computing: computing[-1].add(item)
+
         if dict.has_key(self, item):
             return dict.__getitem__(self, item)
 
-        for m,f in self.__class__.__dict__.iteritems():
-            if hasattr(f, 'lens_model_prop_name'):
-                if item == f.lens_model_prop_name:
-                    return f(self)
+        if item in values:
+            return values[item]
 
-        s = item.rsplit(None,1)
-        if len(s) == 2:
-            for m,f in self.__class__.__dict__.iteritems():
-                if hasattr(f, 'lens_model_prop_name'):
-                    if s[0] == f.lens_model_prop_name:
-                        return f(self, [s[1]])
+        props = _props(self.__class__)
+        f = props.get(item, None)
+        args = ()
+        if f is None:
+            s = item.rsplit(None,1)
+            if len(s) == 2 and s[0] in props:
+                f, args = props[s[0]], ([s[1]],)
+        if f is None:
+            return None
 
-    def __contains__(self, item):
-        if dict.has_key(self, item):
-            return True
+        computing.append(set())
+        try:
+            v = f(self, *args)
+        finally:
+            d = computing.pop()
+        values[item], deps[item] = v, d
+        return v
 
-        for m,f in self.__class__.__dict__.iteritems():
-            if hasattr(f, 'lens_model_prop_name'):
-                if item == f.lens_model_prop_name:
-                    return True
-        return False
+    def __contains__(self, item):
+        return dict.has_key(self, item) or item in _props(self.__class__)
 
     def has_key(self, item):
         return item in self
@@ -0,0 +1,132 @@
+from __future__ import division
+import os
+import time
+import struct
+import cPickle as pickle
+import numpy as np
+
+#===============================================================================
+# Streaming model sink.
+#
+# Solutions are appended to a flat file as they are generated:
+#
+#   magic      8 bytes   'GLASSINK'
+#   version    uint32
+#   (unused)   uint32
+#   nvars      uint64
+#   solutions  nvars float64 each, one after the other
+#
+# At most 'buffer' solutions are held in memory before they are written out.
+# Every 'sync_interval' seconds the file is fsync'ed and the index, fname.idx,
+# is atomically replaced. The index holds the number of solutions known to be
+# on disk and the random seed of every run that added to the file. Only the
+# solutions counted in the index are used when a run is resumed.
+#===============================================================================
+
+MAGIC   = 'GLASSINK'
+VERSION = 1
+HEADER  = struct.Struct('<8sIIQ')
+
+class ModelSink:
+
+    def __init__(self, fname, buffer=64, sync_interval=10):
+        assert buffer > 0
+        self.fname         = fname
+        self.buffer        = buffer
+        self.sync_interval = sync_interval
+
+        self.f        = None
+        self.nvars    = None
+        self.count    = 0           # Solutions counted in the index
+        self.written  = 0           # Solutions written to the file
+        self.pending  = []
+        self.segments = []
+        self.last_sync = time.time()
+
+    def resume(self):
+        """Reopen an existing sink and return the solutions persisted so far,
+        as an (n x nvars) array. Anything past the last index update is
+        dropped. A missing sink is started from scratch."""
+        if not os.path.exists(self.fname + '.idx'):
+            return np.empty((0,0))
+
+        with open(self.fname + '.idx', 'rb') as f:
+            idx = pickle.load(f)
+        self.nvars, self.count, self.segments = idx['nvars'], idx['count'], idx['segments']
+        self.written = self.count
+
+        with open(self.fname, 'rb') as f:
+            magic, version, _, nvars = HEADER.unpack(f.read(HEADER.size))
+            assert magic == MAGIC, '%s is not a model sink.' % self.fname
+            assert nvars == self.nvars
+            sols = np.fromfile(f, dtype='<f8', count=self.count * self.nvars)
+        assert sols.size == self.count * self.nvars, '%s is shorter than its index.' % self.fname
+
+        self.f = open(self.fname, 'r+b')
+        self.f.truncate(HEADER.size + self.count * self.nvars * 8)
+        self.f.seek(0, os.SEEK_END)
+
+        return sols.reshape(self.count, self.nvars)
+
+    def next_seed(self):
+        """A seed for the next run that differs from those already used. None
+        if nothing has been persisted yet."""
+        if not self.segments: return None
+        seed = self.segments[-1]['seed']
+        if seed is None: return None
+        return seed + self.count
+
+    def begin_segment(self, seed):
+        self.segments.append({'start': self.count + len(self.pending), 'seed': seed, 'time': time.asctime()})
+
+    def append(self, sol):
+        if self.f is None:
+            self.nvars = len(sol)
+            self.f = open(self.fname, 'wb')
+            self.f.write(HEADER.pack(MAGIC, VERSION, 0, self.nvars))
+
+            # The file was just truncated, so an index left by an earlier run
+            # would now count solutions that are gone.
+            self.f.flush()
+            os.fsync(self.f.fileno())
+            self.count = self.written = 0
+            self._write_index()
+        assert len(sol) == self.nvars, 'Solution has %i variables, the sink expects %i.' % (len(sol), self.nvars)
+
+        self.pending.append(np.array(sol, dtype='<f8'))
+        if len(self.pending) >= self.buffer:
+            self.flush()
+
+    def flush(self, sync=False):
+        """Write out the buffered solutions. The file is fsync'ed and the index
+        updated if sync is True or the sync interval has passed."""
+        if self.f is None: return
+
+        for sol in self.pending:
+            sol.tofile(self.f)
+        self.written += len(self.pending)
+        self.pending = []
+        self.f.flush()
+
+        if sync or time.time() - self.last_sync >= self.sync_interval:
+            os.fsync(self.f.fileno())
+            self.count = self.written
+            self._write_index()
+            self.last_sync = time.time()
+
+    def _write_index(self):
+        tmp = self.fname + '.idx.tmp'
+        with open(tmp, 'wb') as f:
+            pickle.dump({'version':  VERSION,
+                         'nvars':    self.nvars,
+                         'count':    self.count,
+                         'segments': self.segments}, f, pickle.HIGHEST_PROTOCOL)
+            f.flush()
+            os.fsync(f.fileno())
+        os.rename(tmp, self.fname + '.idx')
+
+    def close(self):
+        if self.f is None: return
+        self.flush(sync=True)
+        self.f.close()
+        self.f = None
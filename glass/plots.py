@@ -17,6 +17,7 @@ from glass.log import log as Log
 from glass.scales import convert
 from glass.shear import Shear
 from glass.utils import dist_range
+from glass.ensemble import Ensemble
 
 from scipy.ndimage.filters import correlate1d
 from scipy.misc import central_diff_weights
@@ -640,6 +641,44 @@ def _find_key(xs, key):
         key = key[-1]
     return xs[key]
 
+def _ensemble_objplot(models, X, Y, imgs, use):
+    """Stack X and Y over the models for each object, grouped by whether the
+    models were accepted. The positions of the images are added to imgs if it
+    is not None."""
+    x_prop, x_units = X
+    y_prop, y_units = Y
+
+    groups = defaultdict(list)
+    for m in models:
+        groups[m.get('accepted', 2)].append(m)
+
+    objplot = defaultdict(dict)
+    for si in sorted(groups.keys()):
+        ms = groups[si]
+        tag = ''
+        if si==False: tag = 'rejected'
+        if si==True: tag = 'accepted'
+
+        for oi,[obj,data] in enumerate(ms[0]['obj,data']):
+            ens = Ensemble(ms, oi)
+            try:
+                xs = ens.get(x_prop, x_units)
+                ys = ens.get(y_prop, y_units)
+            except KeyError as bad_key:
+                Log( "Missing information for object %s with key %s. Skipping plot." % (obj.name,bad_key) )
+                continue
+
+            objplot[obj][tag] = {'ys':ys, 'xs':xs[-1], 'data':ens.data[-1]}
+
+            if imgs is not None:
+                for i,src in enumerate(obj.sources):
+                    for img in src.images:
+                        imgs[i].update(np.atleast_1d(convert('arcsec to %s' % x_units, np.abs(img.pos), obj.dL, ens.get('nu'))))
+
+            use[si] = 1
+
+    return objplot
+
 def _data_plot(models, X,Y, **kwargs):
     with_legend = False
     use = [0,0,0]
@@ -678,54 +717,11 @@ def _data_plot(models, X,Y, **kwargs):
     xmin, xmax = np.inf, -np.inf
     ymin, ymax = np.inf, -np.inf
 
-    objplot = defaultdict(dict)
-    for mi in xrange(0,upto,every):
-        m = models[mi]
-
-        si = m.get('accepted', 2)
-        tag = ''
-        if si==False: tag = 'rejected'
-        if si==True: tag = 'accepted'
-
-        for [obj, data] in m['obj,data']:
-
-            try:
-                xs = data[x_prop][x_units]
-                ys = data[y_prop][y_units]
-
-                xlabel = _axis_label(xs, x_units) if not xlabel else None
-                ylabel = _axis_label(ys, y_units) if not ylabel else None
-
-                objplot[obj].setdefault(tag, {'ys':[], 'xs':None})
-                objplot[obj][tag]['ys'].append(ys)
-                objplot[obj][tag]['xs'] = xs
-
-                #objplot[obj].setdefault('%s:xs'%tag, xs)
-                #objplot[obj].setdefault('%s:ymax'%tag, ys)
-                #objplot[obj].setdefault('%s:ymin'%tag, ys)
-                #objplot[obj].setdefault('%s:ysum'%tag, np.zeros_like(ys))
-                #objplot[obj].setdefault('%s:count'%tag, 0)
-
-                #objplot[obj]['%s:ymax'%tag]  = np.amax((objplot[obj]['%s:ymax'%tag], ys), axis=0)
-                #objplot[obj]['%s:ymin'%tag]  = np.amin((objplot[obj]['%s:ymin'%tag], ys), axis=0)
-                #objplot[obj]['%s:ysum'%tag] += ys
-                #objplot[obj]['%s:count'%tag] += 1
-
-                if mark_images:
-                    for i,src in enumerate(obj.sources):
-                        for img in src.images:
-                            imgs[i].add(convert('arcsec to %s' % x_units, np.abs(img.pos), obj.dL, data['nu']))
-
-            except KeyError as bad_key:
-                Log( "Missing information for object %s with key %s. Skipping plot." % (obj.name,bad_key) )
-                continue
-
-            use[si] = 1
-
-            s = _styles[si]
-
-            #xmin, xmax = min(xmin, amin(data[X])), max(xmax, amax(data[X]))
-            #ymin, ymax = min(ymin, amin(data[Y])), max(ymax, amax(data[Y]))
+    objplot = _ensemble_objplot(models[0:upto:every], X, Y, imgs if mark_images else None, use)
+    for obj_tags in objplot.itervalues():
+        for v in obj_tags.itervalues():
+            xlabel = xlabel if xlabel else _axis_label(v['data'][x_prop], x_units)
+            ylabel = ylabel if ylabel else _axis_label(v['data'][y_prop], y_units)
 
     for i,tag in enumerate(['rejected', 'accepted', '']):
         for k,v in objplot.iteritems():
@@ -813,55 +809,11 @@ def _data_error_plot(models, X,Y, **kwargs):
     xmin, xmax = np.inf, -np.inf
     ymin, ymax = np.inf, -np.inf
 
-    objplot = defaultdict(dict)
-    for mi in xrange(0,upto,every):
-        m = models[mi]
-
-        si = m.get('accepted', 2)
-        #print si
-        tag = ''
-        if si==False: tag = 'rejected'
-        if si==True: tag = 'accepted'
-
-        for [obj, data] in m['obj,data']:
-
-            try:
-                xs = data[x_prop][x_units]
-                ys = data[y_prop][y_units]
-
-                xlabel = _axis_label(xs, x_units) if not xlabel else xlabel
-                ylabel = _axis_label(ys, y_units) if not ylabel else ylabel
-
-                objplot[obj].setdefault(tag, {'ys':[], 'xs':None})
-                objplot[obj][tag]['ys'].append(ys)
-                objplot[obj][tag]['xs'] = xs
-
-                #objplot[obj].setdefault('%s:xs'%tag, xs)
-                #objplot[obj].setdefault('%s:ymax'%tag, ys)
-                #objplot[obj].setdefault('%s:ymin'%tag, ys)
-                #objplot[obj].setdefault('%s:ysum'%tag, np.zeros_like(ys))
-                #objplot[obj].setdefault('%s:count'%tag, 0)
-
-                #objplot[obj]['%s:ymax'%tag]  = np.amax((objplot[obj]['%s:ymax'%tag], ys), axis=0)
-                #objplot[obj]['%s:ymin'%tag]  = np.amin((objplot[obj]['%s:ymin'%tag], ys), axis=0)
-                #objplot[obj]['%s:ysum'%tag] += ys
-                #objplot[obj]['%s:count'%tag] += 1
-
-                if mark_images:
-                    for i,src in enumerate(obj.sources):
-                        for img in src.images:
-                            imgs[i].add(convert('arcsec to %s' % x_units, np.abs(img.pos), obj.dL, data['nu']))
-
-            except KeyError as bad_key:
-                Log( "Missing information for object %s with key %s. Skipping plot." % (obj.name,bad_key) )
-                continue
-
-            use[si] = 1
-
-            s = _styles[si]
-
-            #xmin, xmax = min(xmin, amin(data[X])), max(xmax, amax(data[X]))
-            #ymin, ymax = min(ymin, amin(data[Y])), max(ymax, amax(data[Y]))
+    objplot = _ensemble_objplot(models[0:upto:every], X, Y, imgs if mark_images else None, use)
+    for obj_tags in objplot.itervalues():
+        for v in obj_tags.itervalues():
+            xlabel = xlabel if xlabel else _axis_label(v['data'][x_prop], x_units)
+            ylabel = ylabel if ylabel else _axis_label(v['data'][y_prop], y_units)
 
     for i,tag in enumerate(['rejected', 'accepted', '']):
         for k,v in objplot.iteritems():
@@ -1229,19 +1181,18 @@ def shear_plot2d(env, **kwargs):
 _chi2_xlabel = r'$\ln \chi^2$'
 @command
 def chi2_plot(env, models, model0, **kwargs):
-    v = []
+    # The sums run over all models so far, as they always have.
     n_chi2 = 0
     d_chi2 = 0
-    for m in models:
-        total_chi2 = 0
-        for m1,m2 in izip(m['obj,data'], model0['obj,data']):
-            obj,data = m1
-            obj0,data0 = m2
-            mass0 = data0['kappa'] * convert('kappa to Msun/arcsec^2', 1, obj0.dL, data0['nu'])
-            mass1 = data['kappa'] * convert('kappa to Msun/arcsec^2', 1, obj.dL, data['nu'])
-            n_chi2 += np.sum((mass1 - mass0)**2)
-            d_chi2 += np.sum(mass0**2)
-        v.append(np.log(n_chi2/d_chi2))
+    for i,[obj0,data0] in enumerate(model0['obj,data']):
+        ens = Ensemble(models, i)
+        if not len(ens): break
+        mass0 = data0['kappa'] * convert('kappa to Msun/arcsec^2', 1, obj0.dL, data0['nu'])
+        mass1 = ens.get('kappa') * convert('kappa to Msun/arcsec^2', 1, ens.obj.dL, ens.get('nu'))[:,None]
+        dm = mass1 - mass0
+        n_chi2 = n_chi2 + np.einsum('ij,ij->i', dm, dm)
+        d_chi2 = d_chi2 + np.sum(mass0**2)
+    v = np.log(np.cumsum(n_chi2) / (np.arange(1, len(models)+1) * d_chi2)) if models else []
     pl.hist(v, histtype='step', log=False, **kwargs)
     pl.xlabel(_chi2_xlabel)
     pl.ylabel(r'Count')
@@ -1263,13 +1214,10 @@ def _hist(env, data_key, **kwargs):
     mark_sigma  = kwargs.pop('mark_sigma', True)
 
     # select a list to append to based on the 'accepted' property.
-    l = [[], [], []]
-    for m in models:
-        obj, data = m['obj,data'][obj_index] # For H0 we only have to look at one model because the others are the same
-        if data.has_key(data_key):
-            l[m.get(key,2)].append(data[data_key])
-        #print 'nu', data['nu']
-        #l[2].append(data['kappa'][1])
+    ms = [ m for m in models if m['obj,data'][obj_index][1].has_key(data_key) ]
+    vals = Ensemble(ms, obj_index).get(data_key) if ms else np.array([])
+    tags = np.array([ m.get(key,2) for m in ms ], dtype=int)
+    l = [ vals[tags == i].tolist() for i in range(3) ]
 
     #print amin(l[2]), amax(l[2])
 
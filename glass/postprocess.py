@@ -0,0 +1,99 @@
+from __future__ import division
+import os
+import multiprocessing
+from itertools import izip
+
+from glass.handythread import parallel_map
+
+#===============================================================================
+# Parallel post-processing.
+#
+# run() applies a function f(model, i) to every model, in chunks of
+# consecutive models, and returns the results in model order.
+#
+#   'serial'     one model after the other in this process.
+#   'threads'    chunks are handed to a pool of threads. The models are
+#                changed in place, as in serial mode.
+#   'processes'  chunks are handed to forked worker processes. The models are
+#                set up before the fork, so the workers share the parent's
+#                copy of the solutions rather than receiving them pickled.
+#                Items that f sets in a model's data are sent back and set in
+#                the parent's copy, in model order. Changes made to data
+#                without setting an item are not seen by the parent.
+#===============================================================================
+
+MODES = ['serial', 'threads', 'processes']
+
+# Read by the forked workers.
+_models = None
+_f      = None
+
+_recording_types = {}
+
+def _record_writes(data):
+    """Make data remember which items are set. Plain dicts cannot change
+    class and are sent back whole instead."""
+    t = type(data)
+    if t is dict: return
+    r = _recording_types.get(t, None)
+    if r is None:
+        def __setitem__(self, k, v):
+            t.__setitem__(self, k, v)
+            self.__dict__.setdefault('_written', set()).add(k)
+        r = _recording_types[t] = type(t.__name__, (t,), {'__setitem__': __setitem__})
+    data.__class__ = r
+
+def _written(data):
+    if type(data) is dict:
+        return dict(data)
+    keys = data.__dict__.pop('_written', ())
+    return dict((k, dict.__getitem__(data, k)) for k in keys if dict.__contains__(data, k))
+
+def _run_chunk(bounds):
+    out = []
+    for i in xrange(*bounds):
+        m = _models[i]
+        for _,data in m['obj,data']: _record_writes(data)
+        r = _f(m, i)
+        out.append((r, [ _written(data) for _,data in m['obj,data'] ]))
+    return out
+
+def _chunks(n, size):
+    return [ (i, min(i+size, n)) for i in xrange(0, n, size) ]
+
+def run(models, f, mode='serial', nworkers=1, chunksize=16):
+    global _models, _f
+
+    assert mode in MODES, 'Unknown post-processing mode %s' % mode
+    if mode == 'processes' and not hasattr(os, 'fork'): mode = 'threads'
+    if nworkers <= 1 or len(models) <= chunksize: mode = 'serial'
+
+    if mode == 'serial':
+        return [ f(m,i) for i,m in enumerate(models) ]
+
+    chunks = _chunks(len(models), chunksize)
+
+    if mode == 'threads':
+        results = parallel_map(lambda b: [ f(models[i],i) for i in xrange(*b) ], chunks, threads=nworkers)
+        return [ r for rs in results for r in rs ]
+
+    _models, _f = models, f
+    try:
+        pool = multiprocessing.Pool(nworkers)
+        try:
+            results = []
+            for b,rs in izip(chunks, pool.imap(_run_chunk, chunks)):
+                for i,(r,written) in izip(xrange(*b), rs):
+                    for [_,data],w in izip(models[i]['obj,data'], written):
+                        for k,v in w.iteritems(): data[k] = v
+                    results.append(r)
+            pool.close()
+        except:
+            pool.terminate()
+            raise
+        finally:
+            pool.join()
+    finally:
+        _models, _f = None, None
+
+    return results
@@ -82,11 +82,6 @@ def report(env):
     Log( '=' * 80 )
     Log( 'Number of CPUs detected = %i' % Environment.global_opts['ncpus_detected'] )
     Log( 'Number of CPUs used     = %i' % Environment.global_opts['ncpus'] )
-    oo = Environment.global_opts['omp_opts']
-    if oo:
-        Log( 'OpenMP supported. Compiling with "%s"' % ' '.join(oo['extra_compile_args'] + oo['extra_link_args']) )
-    else:
-        Log( 'OpenMP not supported.' )
     Log( )
 
 
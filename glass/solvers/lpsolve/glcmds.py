@@ -1,19 +1,19 @@
-from environment import env, command
+from glass.command import command
 
 @command
-def samplex_random_seed(s):
-    env().model_gen_options['rngseed'] = s
+def samplex_random_seed(env, s):
+    env.model_gen_options['rngseed'] = s
 
 @command
-def samplex_objective_function(type):
+def samplex_objective_function(env, type):
     assert type in ['facet', 'random']
-    env().model_gen_options['objf choice'] = type
+    env.model_gen_options['objf choice'] = type
 
 @command
-def samplex_solution_type(type):
+def samplex_solution_type(env, type):
     assert type in ['vertex', 'interior', 'CLT', 'CLTvertex']
-    env().model_gen_options['solution type'] = type
+    env.model_gen_options['solution type'] = type
 
 @command
-def samplex_add_noise(n=True):
-    env().model_gen_options['add noise'] = n
+def samplex_add_noise(env, n=True):
+    env.model_gen_options['add noise'] = n
@@ -316,6 +316,7 @@ class Samplex:
     #===========================================================================
 
     def noise(self, a):
+        a = array(a)
         if a[0] == 0:
             w = abs(a) > 1e-14
             w[0] = True
@@ -0,0 +1,19 @@
+from glass.command import command
+
+@command
+def samplex_random_seed(env, s):
+    env.model_gen_options['rngseed'] = s
+
+@command
+def samplex_solution_type(env, type):
+    assert type in ['vertex', 'interior']
+    env.model_gen_options['solution type'] = type
+
+@command
+def samplex_add_noise(env, n=1e-6):
+    env.model_gen_options['add noise'] = n
+
+@command
+def samplex_refactor_period(env, n=64):
+    assert n > 0
+    env.model_gen_options['refactor period'] = n
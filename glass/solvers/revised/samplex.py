@@ -0,0 +1,400 @@
+from __future__ import division
+import numpy as np
+from numpy import zeros, ones, empty, array, arange, concatenate, where, dot
+from numpy import argmin, argmax, amin, amax, inf, isinf, all, any, flatnonzero
+from numpy.random import random, seed as ran_set_seed
+from scipy.sparse import coo_matrix
+from scipy.sparse.linalg import splu
+
+from glass.solvers.error import GlassSolverError
+from glass.solvers.sparse_row import SparseRow
+
+try:
+    from glass.log import log as Log
+except ImportError:
+    def l(x):
+        print x
+    Log = l
+
+#===============================================================================
+# A revised simplex solver. The constraints are kept as a sparse CSC matrix
+# and only the basis is factored, with SuperLU. Each pivot appends an eta
+# vector (product form of the inverse) and the basis is refactored every
+# REFACTOR pivots. Memory goes as the number of nonzero constraint
+# coefficients rather than as the size of the dense tableau used by the other
+# samplex solvers.
+#
+# Constraints are given the same way as for the other solvers: an array a
+# where a[0] is the constant term, so that eq(a) means a[0] + a[1:].x == 0,
+# leq(a) means <= 0 and geq(a) means >= 0. All variables are >= 0.
+#===============================================================================
+
+class SamplexUnboundedError(GlassSolverError):
+    def __init__(self, *args, **kwargs):
+        GlassSolverError.__init__(self, 'Constraints are not strong enough to form a closed solution volume.', *args, **kwargs)
+
+class SamplexNoSolutionError(GlassSolverError):
+    def __init__(self, *args, **kwargs):
+        GlassSolverError.__init__(self, 'Constraints are too strong and no solution exists.', *args, **kwargs)
+
+class SamplexUnexpectedError(GlassSolverError):
+    def __init__(self, *args, **kwargs):
+        GlassSolverError.__init__(self, 'An unexpected error happened.', *args, **kwargs)
+
+class Samplex:
+    OPTIMAL, UNBOUNDED = range(2)
+
+    SML      = 1e-6     # Smallest meaningful step or pivot-row entry
+    ZERO     = 1e-14    # Coefficients this small are not perturbed
+    EPS      = 1e-9     # Feasibility tolerance
+    PIV      = 1e-7     # Smallest pivot relative to the largest column entry
+    DJ_TOL   = 1e-9     # Reduced costs below -DJ_TOL are improving
+    STALL    = 50       # Degenerate pivots before falling back to Bland's rule
+
+    def __init__(self, **kw):
+
+        self.ncols       = kw.get('ncols', None)
+        self.nthreads    = kw.get('nthreads', 1)
+        self.random_seed = kw.get('rngseed',  0)
+        self.sol_type    = kw.get('solution type', 'interior')
+        self.refactor    = kw.get('refactor period', 64)
+        self.noise       = kw.get('add noise', 1e-6)
+
+        assert self.sol_type in ['vertex', 'interior'], 'Unknown solution type %s' % self.sol_type
+
+        ran_set_seed(self.random_seed)
+
+        #-----------------------------------------------------------------------
+        # Constraint rows in coordinate form. kind is 0 for =, +1 for <=, and
+        # -1 for >=, which is also the coefficient of the row's slack.
+        #-----------------------------------------------------------------------
+        self.coo_r = []
+        self.coo_c = []
+        self.coo_v = []
+        self.rhs   = []
+        self.kind  = []
+
+        self.eq_count  = 0
+        self.leq_count = 0
+        self.geq_count = 0
+
+        self.iteration   = 0
+        self.n_solutions = 0
+        self.prev_sol    = None
+        self.curr_sol    = None
+
+    #===========================================================================
+
+    def _add_row(self, a, kind):
+        if self.ncols is None: self.ncols = len(a)-1
+        assert len(a) == self.ncols+1, '%i != %i' % (len(a), self.ncols+1)
+
+        if isinstance(a, SparseRow):
+            k = a.indices > 0
+            nz, v = a.indices[k] - 1, a.values[k]
+        else:
+            nz = flatnonzero(a[1:])
+            v  = a[1:][nz]
+
+        self.coo_r.append(np.repeat(len(self.rhs), nz.size))
+        self.coo_c.append(nz)
+        self.coo_v.append(v)
+        self.rhs.append(-a[0])
+        self.kind.append(kind)
+
+    def add_noise(self, a):
+        """Perturb a homogeneous inequality as the samplex solver does, so
+           that the many constraints through the origin do not meet at one
+           degenerate vertex."""
+        if a[0] != 0: return a
+        if isinstance(a, SparseRow):
+            return a.perturbed(self.ZERO, self.noise * random(1))
+        w = abs(a) > self.ZERO
+        w[0] = True
+        b = a.copy()
+        b[w] += self.noise * random(1)
+        return b
+
+    def eq(self, a):
+        self._add_row(a, 0)
+        self.eq_count += 1
+
+    def leq(self, a):
+        if self.noise: a = self.add_noise(a)
+        self._add_row(a, +1)
+        self.leq_count += 1
+
+    def geq(self, a):
+        if self.noise: a = self.add_noise(a)
+        self._add_row(a, -1)
+        self.geq_count += 1
+
+    #===========================================================================
+
+    def start(self):
+
+        Log( '=' * 80 )
+        Log( 'SAMPLEX (revised simplex, sparse LU)' )
+        Log( '=' * 80 )
+
+        m = len(self.rhs)
+        n = self.ncols
+
+        kind  = array(self.kind, dtype=np.int32)
+        srows = flatnonzero(kind)
+        ns    = srows.size
+
+        #-----------------------------------------------------------------------
+        # Columns are ordered: the n model variables, one slack per
+        # inequality, and one artificial per row. Rows are flipped so that the
+        # right hand side is nonnegative. Inequalities with a zero right hand
+        # side are flipped so that their slack is +1 and can start basic.
+        #-----------------------------------------------------------------------
+        b    = array(self.rhs, dtype=np.float64)
+        sign = where(b < 0, -1.0, 1.0)
+        zero = (b == 0) & (kind != 0)
+        sign[zero] = kind[zero]
+
+        r = concatenate(self.coo_r + [srows, arange(m)])
+        c = concatenate(self.coo_c + [n + arange(ns), n + ns + arange(m)])
+        v = concatenate(self.coo_v + [kind[srows].astype(np.float64), ones(m)])
+
+        v = v * sign[r]
+        v[c >= n+ns] = 1.0
+
+        self.m = m
+        self.N = n + ns
+        self.A  = coo_matrix((v, (r, c)), shape=(m, self.N + m)).tocsc()
+        self.AT = self.A.T.tocsr()
+        self.b  = sign * b
+
+        # Constraints are now stored sparsely.
+        del self.coo_r, self.coo_c, self.coo_v, self.rhs
+
+        #-----------------------------------------------------------------------
+        # Start from the slacks that have a +1 in their row after the flip,
+        # and artificials everywhere else.
+        #-----------------------------------------------------------------------
+        self.basis = self.N + arange(m)
+        plus = srows[kind[srows] * sign[srows] > 0]
+        self.basis[plus] = n + flatnonzero(kind[srows] * sign[srows] > 0)
+
+        Log( "ncols          = %i" % n )
+        Log( "rows           = %i" % m )
+        Log( "nonzeros       = %i" % (self.A.nnz - m) )
+        Log( "random seed    = %s" % self.random_seed )
+        Log( "solution type  = %s" % self.sol_type )
+        Log( "refactor every = %i" % self.refactor )
+        Log( "with noise     = %s" % self.noise )
+        Log( "%6s %6s %6s\n%6i %6i %6i"
+            % (">=", "<=", "=", self.geq_count, self.leq_count, self.eq_count) )
+
+    #===========================================================================
+    # Basis factorization
+    #===========================================================================
+
+    def factor(self):
+        self.lu   = splu(self.A[:, self.basis].tocsc())
+        self.etas = []
+        self.xB   = self.lu.solve(self.b)
+        self.xB[self.xB < 0] = 0
+
+    def ftran(self, y):
+        """Solve B x = y."""
+        x = self.lu.solve(y)
+        for r,d in self.etas:
+            xr = x[r] / d[r]
+            x -= d * xr
+            x[r] = xr
+        return x
+
+    def btran(self, c):
+        """Solve B^T y = c."""
+        c = c.copy()
+        for r,d in reversed(self.etas):
+            c[r] = (c[r] - dot(d,c) + d[r]*c[r]) / d[r]
+        return self.lu.solve(c, trans='T')
+
+    def column(self, j):
+        return self.A.getcol(j).toarray().ravel()
+
+    def exchange(self, r, q, dq):
+        """Basic variable r leaves and column q, with B^-1 a_q = dq, enters."""
+        t = self.xB[r] / dq[r]
+        self.xB -= t * dq
+        self.xB[r] = t
+        self.xB[self.xB < 0] = 0
+        self.basis[r] = q
+        self.etas.append((r, dq))
+        if len(self.etas) >= self.refactor:
+            self.factor()
+        return t
+
+    #===========================================================================
+
+    def iterate(self, cost, allowed):
+        """Minimize cost.x over the columns in allowed, from the current basis."""
+
+        stall = 0
+        while True:
+            y = self.btran(cost[self.basis])
+            d = cost - self.AT.dot(y)
+            d[self.basis] = 0
+            d[~allowed]   = 0
+
+            cand = flatnonzero(d < -self.DJ_TOL)
+            if cand.size == 0: return self.OPTIMAL
+
+            #-------------------------------------------------------------------
+            # Dantzig's rule, or Bland's rule while we are stuck on a
+            # degenerate vertex.
+            #-------------------------------------------------------------------
+            bland = stall > self.STALL
+            q = cand[0] if bland else cand[argmin(d[cand])]
+
+            dq  = self.ftran(self.column(q))
+            pos = flatnonzero(dq > self.PIV * max(1, amax(abs(dq))))
+            if pos.size == 0: return self.UNBOUNDED
+
+            #-------------------------------------------------------------------
+            # Harris' ratio test. The first pass finds the longest step that
+            # keeps every basic variable above -EPS; any row that blocks
+            # before it may leave, so tiny pivots can be avoided.
+            #-------------------------------------------------------------------
+            tmax = amin((self.xB[pos] + self.EPS) / dq[pos])
+            ties = pos[self.xB[pos] / dq[pos] <= tmax]
+
+            #-------------------------------------------------------------------
+            # Prefer artificial variables to leave. Otherwise take the largest
+            # pivot element, or the lowest variable index under Bland's rule.
+            #-------------------------------------------------------------------
+            art = ties[self.basis[ties] >= self.N]
+            if art.size:  r = art[argmax(dq[art])]
+            elif bland:   r = ties[argmin(self.basis[ties])]
+            else:         r = ties[argmax(dq[ties])]
+
+            t = self.exchange(r, q, dq)
+
+            stall = stall+1 if t <= self.EPS else 0
+            self.iteration += 1
+
+    def find_feasible(self):
+
+        Log( "find_feasible" )
+
+        self.factor()
+
+        ntot = self.N + self.m
+        cost = zeros(ntot)
+        cost[self.N:] = 1
+
+        self.iteration = 0
+        if self.iterate(cost, ones(ntot, dtype=bool)) != self.OPTIMAL:
+            raise SamplexUnexpectedError()
+
+        art = flatnonzero(self.basis >= self.N)
+        if any(self.xB[art] > self.SML):
+            raise SamplexNoSolutionError()
+
+        #-----------------------------------------------------------------------
+        # Pivot the remaining artificials (all at zero) out of the basis. If
+        # nothing can replace one its row is redundant and it stays, at zero.
+        #-----------------------------------------------------------------------
+        inbasis = zeros(ntot, dtype=bool)
+        inbasis[self.basis] = True
+        for r in art:
+            e = zeros(self.m); e[r] = 1
+            alpha = self.AT.dot(self.btran(e))[:self.N]
+            alpha[inbasis[:self.N]] = 0
+            j = argmax(abs(alpha))
+            if abs(alpha[j]) < self.SML: continue
+
+            inbasis[self.basis[r]] = False
+            inbasis[j] = True
+            self.exchange(r, j, self.ftran(self.column(j)))
+
+        self.allowed = ones(ntot, dtype=bool)
+        self.allowed[self.N:] = False
+
+        Log( "Feasible after %i pivots" % self.iteration )
+
+    #===========================================================================
+
+    def next(self, nsolutions=None):
+
+        Log( "Getting solutions" )
+
+        self.find_feasible()
+
+        Log( "------------------------------------" )
+        Log( "Found feasible" )
+        Log( "------------------------------------" )
+
+        self.curr_sol = self.package_solution(zeros(self.N + self.m))
+        self.prev_sol = self.curr_sol.copy()
+
+        self.n_solutions = 0
+        while self.n_solutions != nsolutions:
+            self.n_solutions += 1
+            while True:
+                self.curr_sol = self.next_solution()
+
+                if self.sol_type == 'vertex':
+                    p = self.curr_sol.copy()
+                else:
+                    p = self.interior_point()
+
+                if p is not None:
+                    break
+
+                Log( 'SAME VERTEX!' )
+
+            yield p[:self.ncols+1]
+
+    def next_solution(self):
+        cost = zeros(self.N + self.m)
+        cost[:self.N] = random(self.N) - 0.5
+
+        self.iteration = 0
+        if self.iterate(cost, self.allowed) == self.UNBOUNDED:
+            raise SamplexUnboundedError()
+
+        Log( "model %i]  iter % 5i" % (self.n_solutions, self.iteration) )
+
+        return self.package_solution(cost)
+
+    def package_solution(self, cost):
+        """The current vertex: objective value followed by the model and
+           slack variables."""
+        x = zeros(self.N + self.m)
+        x[self.basis] = self.xB
+
+        s = empty(self.N + 1)
+        s[0]  = dot(cost, x)
+        s[1:] = x[:self.N]
+        return s
+
+    def interior_point(self, r=None):
+        """Step from the current vertex towards and past the last interior
+           point, a random fraction of the way to the boundary. Slacks are
+           included so every inequality is covered; equalities hold
+           anywhere on the line."""
+
+        if r is None: r = random()
+
+        iv   = self.curr_sol[1:]
+        dist = iv - self.prev_sol[1:]
+        a = dist > self.SML
+        if not any(a): return None
+
+        smallest_scale = amin(iv[a] / dist[a])
+
+        assert not isinf(smallest_scale)
+        assert smallest_scale > 0.99, smallest_scale
+
+        k = smallest_scale * (1.0-r)
+
+        self.prev_sol[1:] = iv + k * (self.prev_sol[1:] - iv)
+        self.prev_sol[1:][self.prev_sol[1:] < 0] = 0
+
+        return self.prev_sol.copy()
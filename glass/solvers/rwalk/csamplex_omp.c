@@ -19,18 +19,11 @@
 
 #include <sched.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "timing.h"
 
-#define WITH_WELL 0
-
-#if WITH_WELL
-#include "WELL44497a.h"
-#define U01 WELLRNG44497a
-#else
-#define U01 drand48
-#endif
-
 /*==========================================================================*/
 /* Timing variables                                                         */
 /*==========================================================================*/
@@ -52,173 +45,399 @@ typedef struct
 {
     uint32_t cols;
     uint32_t rows;
+    uint32_t ld;        /* leading dimension of a transposed matrix */
     dble_t * restrict orig;
     dble_t * restrict data;
     dble_t * restrict pcol;
 } matrix_t __attribute__ ((aligned(8)));
 
-PyObject *samplex_rwalk(PyObject *self, PyObject *args);
+/* Per-walker random number state. See rng_seed(). */
+typedef struct
+{
+    uint32_t key[2];
+    uint32_t ctr[4];
+    uint32_t buf[4];
+    uint32_t nbuf;
+    uint32_t pad;
+} rng_t;
+
+PyObject *samplex_rwalk_many(PyObject *self, PyObject *args);
 PyObject *samplex_refine_center(PyObject *self, PyObject *args);
-PyObject *set_rwalk_seed(PyObject *self, PyObject *args);
+PyObject *samplex_seed_rng(PyObject *self, PyObject *args);
+static void select_kernels();
+static void load_blas();
 
 static PyMethodDef csamplex_methods[] = 
 {
-    {"rwalk", samplex_rwalk, METH_VARARGS, "rwalk"},
-    {"set_rwalk_seed", set_rwalk_seed, METH_O, "set_rwalk_seed"},
+    {"rwalk_many", samplex_rwalk_many, METH_VARARGS, "rwalk_many"},
+    {"seed_rng", samplex_seed_rng, METH_VARARGS, "seed_rng"},
     {"refine_center", samplex_refine_center, METH_VARARGS, "refine_center"},
     {NULL, NULL, 0, NULL}
 };
 
+/*==========================================================================*/
+/* The random walk works on a transposed copy of the rotated constraint     */
+/* matrix. Row k of the array holds column k of the constraints, so an      */
+/* eigen-direction is one contiguous, 64-byte aligned vector of length ld.  */
+/*==========================================================================*/
+#define EQS_ALIGN 64
+
+static void get_transposed_eqs(PyObject *po_eqs, long rows, matrix_t *eqs)
+{
+    eqs->data = (double * restrict)PyArray_DATA(po_eqs);
+    eqs->cols = PyArray_DIM(po_eqs,0);
+    eqs->ld   = PyArray_DIM(po_eqs,1);
+    eqs->rows = rows;
+
+    assert(eqs->ld >= eqs->rows);
+    assert(((uintptr_t)eqs->data % EQS_ALIGN) == 0);
+    assert(((eqs->ld * sizeof(double)) % EQS_ALIGN) == 0);
+}
+
 PyMODINIT_FUNC initcsamplex()
 {
-    (void)Py_InitModule("csamplex", csamplex_methods);
+    PyObject *m = Py_InitModule("csamplex", csamplex_methods);
+    PyModule_AddIntConstant(m, "RNG_STATE_SIZE", sizeof(rng_t));
+    select_kernels();
+    load_blas();
 }
 
-double ggl(double *ds)
+/*==========================================================================*/
+/* Every walker owns its random number state so that walkers can run in    */
+/* parallel threads. The generator is the counter-based Philox4x32-10      */
+/* (Salmon et al. 2011). Walker k of a run with seed s uses the key s and  */
+/* stream k in the high word of the counter, so its numbers depend only on */
+/* (s,k) and not on how the walkers are split over threads or processes.   */
+/*==========================================================================*/
+
+static void rng_seed(rng_t *rng, uint64_t seed, uint32_t stream)
 {
-    /* generate u(0,1) distributed random numbers.
-    Seed ds must be saved between calls. ggl is
-    essentially the same as the IMSL routine RNUM.
+    memset(rng, 0, sizeof(*rng));
+    rng->key[0] = (uint32_t)seed;
+    rng->key[1] = (uint32_t)(seed >> 32);
+    rng->ctr[3] = stream;
+}
 
-    W. Petersen and M. Troyer, 24 Oct. 2002, ETHZ */
+static inline void philox4x32_10(uint32_t ctr[4], uint32_t key[2], uint32_t out[4])
+{
+    int r;
+    uint32_t c0=ctr[0], c1=ctr[1], c2=ctr[2], c3=ctr[3];
+    uint32_t k0=key[0], k1=key[1];
 
-    double t,d2=0.2147483647e10;
-    t = (double) *ds;
-    t = fmod(0.16807e5*t,d2);
-    *ds = t;
-    return((double)((t-1.0e0)/(d2-1.0e0)));
+    for (r=0; r < 10; r++)
+    {
+        const uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+        const uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+
+    out[0]=c0; out[1]=c1; out[2]=c2; out[3]=c3;
 }
 
-PyObject *set_rwalk_seed(PyObject *self, PyObject *args)
+static inline uint32_t rng_next32(rng_t *rng)
 {
-    double seed;
-    if (args == Py_None)
-        seed = time(NULL);
-    else
-        seed = PyInt_AsLong(args);
- 
-#if WITH_WELL
-    unsigned int init[1391];
-    double scale = 5.0e+9; // almost any big scale factor will work
-    int i;
-    for(i=0;i<1391;i++) init[i] = (unsigned int) scale*ggl(&seed);
-    InitWELLRNG44497a(init);
-#else
-    srand48(seed);
-#endif
+    if (rng->nbuf == 0)
+    {
+        philox4x32_10(rng->ctr, rng->key, rng->buf);
+        /* 96-bit counter; the high word is the stream. */
+        if (++rng->ctr[0] == 0)
+            if (++rng->ctr[1] == 0)
+                ++rng->ctr[2];
+        rng->nbuf = 4;
+    }
+    return rng->buf[--rng->nbuf];
+}
 
-    //fprintf(stderr, "First random number is %f\n", U01());
+/* Uniform on [0,1) with 53 random bits. */
+static inline double rng_u01(rng_t *rng)
+{
+    const uint32_t a = rng_next32(rng) >> 5;
+    const uint32_t b = rng_next32(rng) >> 6;
+    return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+}
 
+/*==========================================================================*/
+/* seed_rng(rng, seed)                                                      */
+/*                                                                          */
+/* Seed the per-walker states in the rows of the uint8 array rng, which     */
+/* must have RNG_STATE_SIZE columns. Row k becomes stream k of seed.        */
+/*==========================================================================*/
+PyObject *samplex_seed_rng(PyObject *self, PyObject *args)
+{
+    long k;
+    long seed;
+    PyObject *po_rng;
+
+    if (!PyArg_ParseTuple(args, "Ol", &po_rng, &seed))
+        return NULL;
+
+    assert(PyArray_DIM(po_rng,1) == sizeof(rng_t));
+
+    rng_t *rng = (rng_t *)PyArray_DATA(po_rng);
+    for (k=0; k < PyArray_DIM(po_rng,0); k++)
+        rng_seed(rng + k, seed, k);
+
+    Py_INCREF(Py_None);
     return Py_None;
 }
 
 /*****************************************************************************/
 /*****************************************************************************/
 
-void normal(double stddev, double mean, double *r0, double *r1)
+/*==========================================================================*/
+/* Fill out[0..n) with standard normal deviates, n even. The uniforms are   */
+/* drawn first so that the Box-Muller transform is a branch-free loop the   */
+/* compiler can vectorize. There is no rejection step.                      */
+/*==========================================================================*/
+#define NORMAL_BATCH 64
+
+static void rng_normals(rng_t *rng, double * restrict out, const long n)
 {
+    long i;
+    double u[NORMAL_BATCH];
+
+    assert(n <= NORMAL_BATCH && !(n & 1));
+
+    for (i=0; i < n; i++)
+        u[i] = rng_u01(rng);
 
-    double x1, x2, w, y1, y2;
- 
-    do 
+    for (i=0; i < n; i += 2)
     {
-        x1 = 2.0 * U01() - 1.0;
-        x2 = 2.0 * U01() - 1.0;
-        w = x1 * x1 + x2 * x2;
-    } while (w >= 1.0);
-
-    w = sqrt((-2.0 * log(w)) / w);
-    y1 = x1 * w;
-    y2 = x2 * w;
-
-    // XXX
-    //y1 = 2.0 * drand48() - 1.0;
-    //y2 = 2.0 * drand48() - 1.0;
-    // XXX
-    *r0 = y1 * stddev + mean;
-    *r1 = y2 * stddev + mean;
+        const double rad   = sqrt(-2.0 * log(1.0 - u[i]));
+        const double theta = 2.0 * M_PI * u[i+1];
+        out[i]   = rad * cos(theta);
+        out[i+1] = rad * sin(theta);
+    }
 }
 
-PyObject *samplex_rwalk(PyObject *self, PyObject *args)
+/*==========================================================================*/
+/* Fused slack kernels for the walk. A proposed step is tested directly     */
+/* against S without materializing the new slacks, and S is only updated,   */
+/* in place, once the step has been accepted.                               */
+/*                                                                          */
+/* The leq rows are stored negated (see transposed_eqs() in samplex.py) so  */
+/* that every inequality row i is satisfied when S[i] >= 0.                 */
+/*                                                                          */
+/* The products are never fused into an FMA. The feasibility test and the  */
+/* update must round identically, otherwise an accepted step could leave a  */
+/* slack marginally negative and stall the walker.                          */
+/*==========================================================================*/
+typedef int (*feasible_fn_t)(const dble_t * restrict S,
+                             const dble_t * restrict col,
+                             const double step,
+                             const long offs, const long rows);
+
+static int step_is_feasible_scalar(const dble_t * restrict S,
+                                   const dble_t * restrict col,
+                                   const double step,
+                                   const long offs, const long rows)
 {
-    int32_t i,j;
-    matrix_t eqs;
+    long i;
+    for (i=offs; i < rows; i++)
+        if (S[i] + step * col[i] < 0) return 0;
+    return 1;
+}
 
-    DBG(3) fprintf(stderr, "5> pivot()\n");
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-    long accepted;
-    long rejected;
-    double twiddle;
+/* Blocks of 8 rows, two AVX registers, with one mask test per block. */
+__attribute__ ((target("avx2")))
+static int step_is_feasible_avx2(const dble_t * restrict S,
+                                 const dble_t * restrict col,
+                                 const double step,
+                                 const long offs, const long rows)
+{
+    long i;
+    const __m256d vstep = _mm256_set1_pd(step);
+    const __m256d zero  = _mm256_setzero_pd();
 
-    PyObject *po_vec;
-    PyObject *po_eval;
-    PyObject *po_eqs;
-    PyObject *po_S;
-    PyObject *po_S0;
+    for (i=offs; i+8 <= rows; i += 8)
+    {
+        __m256d s0 = _mm256_add_pd(_mm256_loadu_pd(S+i),   _mm256_mul_pd(vstep, _mm256_loadu_pd(col+i)));
+        __m256d s1 = _mm256_add_pd(_mm256_loadu_pd(S+i+4), _mm256_mul_pd(vstep, _mm256_loadu_pd(col+i+4)));
+        __m256d m  = _mm256_or_pd(_mm256_cmp_pd(s0, zero, _CMP_LT_OQ),
+                                  _mm256_cmp_pd(s1, zero, _CMP_LT_OQ));
+        if (_mm256_movemask_pd(m)) return 0;
+    }
 
-    if (!PyArg_ParseTuple(args, "OOOOOOdll", &self, &po_eqs, &po_vec, &po_eval, &po_S, &po_S0, &twiddle, &accepted, &rejected))
-        return NULL;
+    for (; i < rows; i++)
+        if (S[i] + step * col[i] < 0) return 0;
+    return 1;
+}
 
-          long redo = PyInt_AsLong(PyObject_GetAttrString(self, "redo"));
-    const long dim = PyInt_AsLong(PyObject_GetAttrString(self, "dim"));
-    const long dof = PyInt_AsLong(PyObject_GetAttrString(self, "dof"));
+/* Blocks of 16 rows, two AVX-512 registers, with one mask test per block. */
+__attribute__ ((target("avx512f")))
+static int step_is_feasible_avx512(const dble_t * restrict S,
+                                   const dble_t * restrict col,
+                                   const double step,
+                                   const long offs, const long rows)
+{
+    long i;
+    const __m512d vstep = _mm512_set1_pd(step);
+    const __m512d zero  = _mm512_setzero_pd();
 
-    const long  eq_count = PyInt_AsLong(PyObject_GetAttrString(self, "eq_count"));
-    const long geq_count = PyInt_AsLong(PyObject_GetAttrString(self, "geq_count"));
-    const long leq_count = PyInt_AsLong(PyObject_GetAttrString(self, "leq_count"));
+    for (i=offs; i+16 <= rows; i += 16)
+    {
+        __m512d s0 = _mm512_add_pd(_mm512_loadu_pd(S+i),   _mm512_mul_pd(vstep, _mm512_loadu_pd(col+i)));
+        __m512d s1 = _mm512_add_pd(_mm512_loadu_pd(S+i+8), _mm512_mul_pd(vstep, _mm512_loadu_pd(col+i+8)));
+        if (_mm512_cmp_pd_mask(s0, zero, _CMP_LT_OQ) | _mm512_cmp_pd_mask(s1, zero, _CMP_LT_OQ)) 
+            return 0;
+    }
 
-    dble_t * restrict vec  = (dble_t * restrict)PyArray_DATA(po_vec), 
-           * restrict eval = (dble_t * restrict)PyArray_DATA(po_eval),
-           * restrict S    = (dble_t * restrict)PyArray_DATA(po_S),
-           * restrict S0   = (dble_t * restrict)PyArray_DATA(po_S0);
+    for (; i < rows; i++)
+        if (S[i] + step * col[i] < 0) return 0;
+    return 1;
+}
+#endif
 
+static feasible_fn_t step_is_feasible = step_is_feasible_scalar;
 
-    double * data_ptr;
-    eqs.data = (double * restrict)PyArray_DATA(po_eqs);
-    eqs.rows = PyArray_DIM(po_eqs,0);
-    eqs.cols = PyArray_DIM(po_eqs,1);
+/* Pick the widest feasibility kernel the CPU supports. */
+static void select_kernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        step_is_feasible = step_is_feasible_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        step_is_feasible = step_is_feasible_avx2;
+#endif
+}
 
-    const long eq_offs = 0;
-    const long leq_offs = eq_offs + eq_count;
-    const long geq_offs = leq_offs + leq_count;
+static inline void update_slacks(dble_t * restrict S,
+                                 const dble_t * restrict col,
+                                 const double step,
+                                 const long offs, const long rows)
+{
+    long i;
+    for (i=offs; i < rows; i++)
+        S[i] += step * col[i];
+}
 
-    //fprintf(stderr, "eq  %ld %ld\n", eq_offs, eq_count);
-    //fprintf(stderr, "leq %ld %ld\n", leq_offs, leq_count);
-    //fprintf(stderr, "geq %ld %ld\n", geq_offs, geq_count);
-    //fprintf(stderr, "redo %ld\n", redo);
-    //fprintf(stderr, "accepted/rejected/twiddle %ld %ld %e\n", accepted,rejected,twiddle);
+/*==========================================================================*/
+/* Find the chord [*tlo,*thi] of the polytope through the current point     */
+/* along col in a single pass. Used by the hit-and-run step mode.           */
+/*==========================================================================*/
+static inline void chord(const dble_t * restrict S,
+                         const dble_t * restrict col,
+                         const long offs, const long rows,
+                         double *tlo, double *thi)
+{
+    long i;
+    double t;
+    double lo = -DBL_MAX;
+    double hi = +DBL_MAX;
 
-    double redo_etime, redo_stime;
+    /* S + t*col >= 0 */
+    for (i=offs; i < rows; i++)
+    {
+        if (col[i] == 0) continue;
+        t = -S[i] / col[i];
+        if (col[i] < 0) { if (t < hi) hi = t; }
+        else            { if (t > lo) lo = t; }
+    }
 
-    //Py_BEGIN_ALLOW_THREADS
+    assert(lo != -DBL_MAX);
+    assert(hi != +DBL_MAX);
 
-    for (i=0; i < eqs.rows; i++)
-    {
-        long offs = i * eqs.cols;
+    /* Round-off can leave the point marginally outside a plane. */
+    if (lo > 0) lo = 0;
+    if (hi < 0) hi = 0;
 
-        S[i] = eqs.data[offs++];
-        for (j=0; j < dim; j++)
-            S[i] += vec[j] * eqs.data[offs++];
-    }
+    *tlo = lo;
+    *thi = hi;
+}
 
-    double r,r1;
-    double step;
-    long walk_step;
-    long dir_index;
-    double stddev = twiddle/sqrt(dof);
+/*==========================================================================*/
+/* The walk itself. walk_t holds what all walkers share and only read;      */
+/* walker_t holds the state of one walker. walk() touches no Python objects */
+/* and is called without the GIL, possibly from several threads at once.    */
+/*==========================================================================*/
+typedef struct
+{
+    const matrix_t *eqs;
+    const dble_t *eval;
+    const long *dir_indices;
+    long ndirs;
+    long dim;
+    long dof;
+    long leq_offs;
+    long redo;
+    int hit_and_run;
+
+    /* Only used by rwalk_many to turn walker positions into samples. */
+    const dble_t *evec;     /* dim x dim, Fortran order */
+    const dble_t *A;        /* eq_count x dim, C order  */
+    const dble_t *b;        /* eq_count                 */
+    const dble_t *Apinv;    /* dim x eq_count, C order  */
+    long eq_count;
+    long nsamples;
+} walk_t;
 
+typedef struct
+{
+    const walk_t *w;
+    dble_t *vec;
+    dble_t *S;
+    double twiddle;
+    rng_t *rng;
+    long accepted;
+    long rejected;
+
+    /* Only used by rwalk_many. */
+    dble_t *x;              /* position in the original basis  */
+    dble_t *out;            /* nsamples x dim                  */
+    long nnegative;
+} walker_t;
+
+/* Only eigen-directions with a non-zero length are walked along. */
+static long *good_directions(const dble_t *eval, long dim, long *ndirs)
+{
+    long j;
     long *dir_indices = (long *)malloc(dim * sizeof(long));
-    long max_good_dim=0;
+    *ndirs = 0;
     for (j=0; j < dim; j++)
     {
         if (fabs(eval[j]) >= 1e-14)
         {
-            dir_indices[max_good_dim++] = j;
+            dir_indices[(*ndirs)++] = j;
         }
     }
+    return dir_indices;
+}
 
-    redo_stime = CPUTIME;
-    for (walk_step = 0; walk_step < redo; walk_step++)
+static void walk(walker_t *wk)
+{
+    long i,j;
+    const walk_t   * restrict w   = wk->w;
+    const matrix_t * restrict eqs = w->eqs;
+    dble_t * restrict vec = wk->vec;
+    dble_t * restrict S   = wk->S;
+
+    memcpy(S, eqs->data, sizeof(*S) * eqs->rows);
+    for (j=0; j < w->dim; j++)
+    {
+        const double v = vec[j];
+        const dble_t * restrict col = __builtin_assume_aligned(eqs->data + (j+1) * eqs->ld, EQS_ALIGN);
+        for (i=0; i < eqs->rows; i++)
+            S[i] += v * col[i];
+    }
+
+    double step;
+    long walk_step;
+    long dir_index;
+    double stddev = wk->twiddle/sqrt(w->dof);
+
+    double normals[NORMAL_BATCH];
+    long   nnormals = 0;
+
+    for (walk_step = 0; walk_step < w->redo; walk_step++)
     {
         /* Choose a random eigen direction */
 //      do
@@ -226,78 +445,318 @@ PyObject *samplex_rwalk(PyObject *self, PyObject *args)
 //          dir_index = U01() * dim;
 //      } while (fabs(eval[dir_index]) < 1e-14);
 
-         dir_index = dir_indices[ (long)(U01() * max_good_dim) ];
+         dir_index = w->dir_indices[ (long)(rng_u01(wk->rng) * w->ndirs) ];
+
+        const dble_t * restrict col = __builtin_assume_aligned(eqs->data + (dir_index+1) * eqs->ld, EQS_ALIGN);
 
-        if (!(walk_step & 1))
+        if (w->hit_and_run)
         {
-            normal(stddev, 0, &r, &r1);
-            //r  = (U01()-0.5) * (6*stddev);
-            //r1 = (U01()-0.5) * (6*stddev);
+            /* Sample uniformly along the chord. Every step is accepted. */
+            double tlo, thi;
+            chord(S, col, w->leq_offs, eqs->rows, &tlo, &thi);
+            step = tlo + rng_u01(wk->rng) * (thi - tlo);
         }
         else
         {
-            r = r1;
+            if (nnormals == 0)
+            {
+                rng_normals(wk->rng, normals, NORMAL_BATCH);
+                nnormals = NORMAL_BATCH;
+            }
+
+            step = stddev * normals[--nnormals] * w->eval[dir_index];
+
+            /* Check if we are still in the simplex */
+            // equalities are ignored
+            if (!step_is_feasible(S, col, step, w->leq_offs, eqs->rows))
+                goto reject;
         }
 
-        step = r * eval[dir_index];
+        /* Take the new point as the current vector for the next round */
+        vec[dir_index] += step;
+        update_slacks(S, col, step, w->leq_offs, eqs->rows);
+        wk->accepted++;
+        continue;
 
-        /* Check if we are still in the simplex */
-        long offs = leq_offs * eqs.cols + dir_index + 1;
-        data_ptr = eqs.data + offs;
+reject:
+        wk->rejected++;
+    }
+}
+
+/*==========================================================================*/
+/* BLAS. dgemv is taken from scipy.linalg.cython_blas when it is available, */
+/* so that the extension does not have to link against a BLAS itself.      */
+/* Otherwise a plain C version with the same interface is used.             */
+/*==========================================================================*/
+typedef void (*dgemv_fn_t)(char *trans, int *m, int *n, double *alpha, double *a, int *lda,
+                           double *x, int *incx, double *beta, double *y, int *incy);
 
+static void dgemv_fallback(char *trans, int *m, int *n, double *alpha, double *a, int *lda,
+                           double *x, int *incx, double *beta, double *y, int *incy)
+{
+    long i,j;
+    assert(*incx == 1 && *incy == 1);
 
-#if 0
-        for (i=eq_offs; accept && i < (eq_offs + eq_count); i++, data_ptr += eqs.cols)
+    if (*trans == 'N')
+    {
+        for (i=0; i < *m; i++) 
+            y[i] = (*beta == 0) ? 0 : *beta * y[i];
+        for (j=0; j < *n; j++)
         {
-            S0[i] = S[i] + (step * *data_ptr);
-            accept = fabs(S0[i]) < 1e-8;
+            const double t = *alpha * x[j];
+            const double *aj = a + j * *lda;
+            for (i=0; i < *m; i++)
+                y[i] += t * aj[i];
         }
-#endif
-
-        // equalities are ignored
-        for (i=leq_offs; i < (leq_offs + leq_count); i++, data_ptr += eqs.cols)
+    }
+    else
+    {
+        for (j=0; j < *n; j++)
         {
-            S0[i] = S[i] + (step * *data_ptr);
+            double t = 0;
+            const double *aj = a + j * *lda;
+            for (i=0; i < *m; i++)
+                t += aj[i] * x[i];
+            y[j] = (*beta == 0) ? *alpha * t : *beta * y[j] + *alpha * t;
         }
+    }
+}
 
+static dgemv_fn_t dgemv = dgemv_fallback;
 
-        //for (i=geq_offs; accept && i < (geq_offs + geq_count); i++, data_ptr += eqs.cols)
-        for (i=geq_offs; i < eqs.rows; i++, data_ptr += eqs.cols)
-        {
-            S0[i] = S[i] + (step * *data_ptr);
-        }
+static void load_blas()
+{
+    PyObject *mod = PyImport_ImportModule("scipy.linalg.cython_blas");
+    PyObject *capi = mod ? PyObject_GetAttrString(mod, "__pyx_capi__") : NULL;
+    PyObject *cap  = capi ? PyDict_GetItemString(capi, "dgemv") : NULL;
 
-        data_ptr = eqs.data + offs;
-        for (i=leq_offs; i < (leq_offs + leq_count); i++, data_ptr += eqs.cols)
-        {
-            if (S0[i] > 0) goto reject;
-        }
-        for (i=geq_offs; i < eqs.rows; i++, data_ptr += eqs.cols)
+    if (cap != NULL && PyCapsule_CheckExact(cap))
+        dgemv = (dgemv_fn_t)PyCapsule_GetPointer(cap, PyCapsule_GetName(cap));
+
+    if (dgemv == NULL) dgemv = dgemv_fallback;
+
+    PyErr_Clear();
+    Py_XDECREF(capi);
+    Py_XDECREF(mod);
+}
+
+/* y <- alpha*op(a)*x + beta*y with a an m x n Fortran-order matrix. */
+static inline void gemv(char trans, int m, int n, double alpha, const dble_t *a, int lda,
+                        const dble_t *x, double beta, dble_t *y)
+{
+    int one = 1;
+    dgemv(&trans, &m, &n, &alpha, (double *)a, &lda, (double *)x, &one, &beta, y, &one);
+}
+
+/*==========================================================================*/
+/* Draw w->nsamples samples, each w->redo steps apart. Each sample is       */
+/* rotated from the eigenbasis back to the original basis and projected    */
+/* onto the equality constraints, as Samplex.project does. The walk         */
+/* continues from the projected point.                                      */
+/*==========================================================================*/
+static void sample_walker(walker_t *wk)
+{
+    long i,j;
+    const walk_t *w = wk->w;
+    const int dim = w->dim;
+    const int neq = w->eq_count;
+
+    dble_t *vec = (dble_t *)malloc(dim * sizeof(*vec));
+    dble_t *q   = (dble_t *)malloc((neq+1) * sizeof(*q));
+
+    wk->vec = vec;
+
+    /* vec = evec^T x */
+    gemv('T', dim, dim, 1, w->evec, dim, wk->x, 0, vec);
+
+    for (i=0; i < w->nsamples; i++)
+    {
+        walk(wk);
+
+        /* x = evec vec */
+        gemv('N', dim, dim, 1, w->evec, dim, vec, 0, wk->x);
+
+        for (j=0; j < dim; j++)
+            if (wk->x[j] < 0) wk->nnegative++;
+
+        if (neq > 0)
         {
-            if (S0[i] < 0) goto reject;
+            /* x -= Apinv (A x + b) */
+            gemv('T', dim, neq,  1, w->A,     dim, wk->x, 0, q);
+            for (j=0; j < neq; j++) q[j] += w->b[j];
+            gemv('T', neq, dim, -1, w->Apinv, neq, q,     1, wk->x);
         }
 
-        //assert(!accept || i==eqs.rows);
+        memcpy(wk->out + i*dim, wk->x, dim * sizeof(*wk->x));
 
-        /* Take the new point as the current vector for the next round */
-        vec[dir_index] += step;
-        memcpy(S, S0, sizeof(*S) * eqs.rows);
-        accepted++;
-        continue;
+        if (i+1 < w->nsamples)
+            gemv('T', dim, dim, 1, w->evec, dim, wk->x, 0, vec);
+    }
 
-reject:
-        rejected++;
+    free(q);
+    free(vec);
+}
+
+static void *walker_thread(void *arg)
+{
+    sample_walker((walker_t *)arg);
+    return NULL;
+}
+
+/* Fill in the parameters shared by all walkers from the Samplex object. */
+static void get_walk(PyObject *self, PyObject *po_eval, const matrix_t *eqs, walk_t *w)
+{
+    w->redo = PyInt_AsLong(PyObject_GetAttrString(self, "redo"));
+    w->dim  = PyInt_AsLong(PyObject_GetAttrString(self, "dim"));
+    w->dof  = PyInt_AsLong(PyObject_GetAttrString(self, "dof"));
+
+    /* The leq rows are pre-negated, so every row from leq_offs on is an  */
+    /* inequality of the form S >= 0.                                    */
+    w->leq_offs = PyInt_AsLong(PyObject_GetAttrString(self, "eq_count"));
+
+    w->hit_and_run = PyObject_IsTrue(PyObject_GetAttrString(self, "hit_and_run"));
+
+    w->eqs  = eqs;
+    w->eval = (dble_t *)PyArray_DATA(po_eval);
+    w->dir_indices = good_directions(w->eval, w->dim, &w->ndirs);
+}
+
+/*==========================================================================*/
+/* rwalk_many(samplex, eqs, vecs, eval, evec, S, twiddles, rng,             */
+/*            accepted, rejected, out)                                      */
+/*                                                                          */
+/* Advance N walkers, one thread per walker, and have each one write K      */
+/* samples, samplex.redo steps apart, into out (N x K x dim). All walkers   */
+/* share the read-only constraint matrix eqs, rotated into the eigenbasis   */
+/* evec (Fortran order). Row k of vecs (positions in the original basis,    */
+/* updated in place), S, rng, and entry k of twiddles, accepted and         */
+/* rejected belong to walker k. The samples are projected with samplex.A,   */
+/* samplex.b and samplex.Apinv when there are equality constraints.         */
+/*                                                                          */
+/* Returns the CPU time used by all threads and the number of negative      */
+/* coordinates seen before projection.                                      */
+/*==========================================================================*/
+PyObject *samplex_rwalk_many(PyObject *self, PyObject *args)
+{
+    long k;
+    matrix_t eqs;
+    walk_t w;
+
+    PyObject *po_vecs;
+    PyObject *po_eval;
+    PyObject *po_evec;
+    PyObject *po_eqs;
+    PyObject *po_S;
+    PyObject *po_twiddles;
+    PyObject *po_rng;
+    PyObject *po_accepted;
+    PyObject *po_rejected;
+    PyObject *po_out;
+
+    if (!PyArg_ParseTuple(args, "OOOOOOOOOOO", &self, &po_eqs, &po_vecs, &po_eval, &po_evec, &po_S, 
+                          &po_twiddles, &po_rng, &po_accepted, &po_rejected, &po_out))
+        return NULL;
+
+    const long nwalkers = PyArray_DIM(po_vecs,0);
+
+    get_transposed_eqs(po_eqs, PyArray_DIM(po_S,1), &eqs);
+    get_walk(self, po_eval, &eqs, &w);
+
+    assert(PyArray_DIM(po_vecs,1) == w.dim);
+    assert(PyArray_DIM(po_S,0) == nwalkers);
+    assert(PyArray_DIM(po_rng,1) == sizeof(rng_t));
+    assert(PyArray_DIM(po_out,0) == nwalkers);
+    assert(PyArray_DIM(po_out,2) == w.dim);
+
+    PyObject *po_Apinv = PyObject_GetAttrString(self, "Apinv");
+    if (po_Apinv != Py_None)
+    {
+        PyObject *po_A = PyObject_GetAttrString(self, "A");
+        PyObject *po_b = PyObject_GetAttrString(self, "b");
+        w.A        = (dble_t *)PyArray_DATA(po_A);
+        w.b        = (dble_t *)PyArray_DATA(po_b);
+        w.Apinv    = (dble_t *)PyArray_DATA(po_Apinv);
+        w.eq_count = PyArray_DIM(po_A,0);
+        Py_DECREF(po_A);
+        Py_DECREF(po_b);
+    }
+    else
+    {
+        w.A = w.b = w.Apinv = NULL;
+        w.eq_count = 0;
+    }
+    Py_DECREF(po_Apinv);
+
+    w.evec     = (dble_t *)PyArray_DATA(po_evec);
+    w.nsamples = PyArray_DIM(po_out,1);
+
+    dble_t *vecs     = (dble_t *)PyArray_DATA(po_vecs);
+    dble_t *S        = (dble_t *)PyArray_DATA(po_S);
+    dble_t *twiddles = (dble_t *)PyArray_DATA(po_twiddles);
+    dble_t *out      = (dble_t *)PyArray_DATA(po_out);
+    rng_t  *rng      = (rng_t  *)PyArray_DATA(po_rng);
+    int64_t *accepted = (int64_t *)PyArray_DATA(po_accepted);
+    int64_t *rejected = (int64_t *)PyArray_DATA(po_rejected);
+
+    walker_t  *wk      = (walker_t  *)malloc(nwalkers * sizeof(*wk));
+    pthread_t *thr     = (pthread_t *)malloc(nwalkers * sizeof(*thr));
+    int32_t   *started = (int32_t   *)malloc(nwalkers * sizeof(*started));
+    if (nwalkers > 0 && (wk == NULL || thr == NULL || started == NULL))
+    {
+        free(started);
+        free(thr);
+        free(wk);
+        free((void *)w.dir_indices);
+        return PyErr_NoMemory();
     }
-    redo_etime = CPUTIME;
 
-    //fprintf(stderr, "%40sTOTAL TOOK %fs\n", " ", redo_etime-redo_stime);
+    for (k=0; k < nwalkers; k++)
+    {
+        wk[k].w         = &w;
+        wk[k].x         = vecs + k*w.dim;
+        wk[k].out       = out  + k*w.nsamples*w.dim;
+        wk[k].S         = S    + k*eqs.rows;
+        wk[k].twiddle   = twiddles[k];
+        wk[k].rng       = rng + k;
+        wk[k].accepted  = accepted[k];
+        wk[k].rejected  = rejected[k];
+        wk[k].nnegative = 0;
+    }
 
-    //Py_END_ALLOW_THREADS
+    double redo_etime, redo_stime;
+    long nnegative = 0;
 
-    free(dir_indices);
+    //--------------------------------------------------------------------------
+    // A walker whose thread cannot be created is run here instead, after the
+    // first walker. Every walker has its own random stream, so the samples
+    // do not depend on which thread runs it.
+    //--------------------------------------------------------------------------
+    redo_stime = CPUTIME;
+    Py_BEGIN_ALLOW_THREADS
+    for (k=1; k < nwalkers; k++)
+        started[k] = pthread_create(thr+k, NULL, walker_thread, wk+k) == 0;
+    if (nwalkers > 0)
+        sample_walker(wk);
+    for (k=1; k < nwalkers; k++)
+        if (!started[k]) sample_walker(wk+k);
+    for (k=1; k < nwalkers; k++)
+        if (started[k]) pthread_join(thr[k], NULL);
+    Py_END_ALLOW_THREADS
+    redo_etime = CPUTIME;
 
-    return Py_BuildValue("llf", accepted, rejected, redo_etime-redo_stime);
-    return PyInt_FromLong(0);
+    for (k=0; k < nwalkers; k++)
+    {
+        accepted[k] = wk[k].accepted;
+        rejected[k] = wk[k].rejected;
+        nnegative  += wk[k].nnegative;
+    }
+
+    free(started);
+    free(thr);
+    free(wk);
+    free((void *)w.dir_indices);
+
+    return Py_BuildValue("dl", redo_etime-redo_stime, nnegative);
 }
 
 double distance_to_plane(int dir, long dir_index, 
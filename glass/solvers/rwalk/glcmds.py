@@ -38,3 +38,8 @@ def samplex_burnin_factor(env, b):
     assert b > 0
     env.model_gen_options['burnin factor'] = b
 
+
+@command
+def samplex_step_mode(env, mode='gaussian'):
+    assert mode in ['gaussian', 'hit_and_run']
+    env.model_gen_options['step mode'] = mode
@@ -9,9 +9,6 @@ try:
 except:
     from scipy.linalg import _fblas as fblas
 
-import multiprocessing as MP
-from Queue import Empty as QueueEmpty
-
 from glass.solvers.error import GlassSolverError
 
 #from glrandom import random, ran_set_seed
@@ -65,201 +62,107 @@ class SamplexSolution:
         self.lhv = None
         self.vertex = None
 
-def rwalk_burnin(id, nmodels, burnin_len, samplex, q, cmdq, ackq, vec, twiddle, eval,evec, seed):
-
-    lclq = []
-
-    S   = np.zeros(samplex.eqs.shape[0])
-    S0  = np.zeros(samplex.eqs.shape[0])
-
-    vec  = vec.copy('A')
-    eval = eval.copy('A')
-    evec = evec.copy('A')
-    eqs  = samplex.eqs.copy('A')
-
-    accepted = 0
-    rejected = 0
-
-    offs = ' '*39
-    Log( offs + 'STARTING rwalk_burnin THREAD %i' % id, overwritable=True)
-
-    eqs[:,1:] = np.dot(samplex.eqs[:,1:], evec)
-    #vec[:] = np.dot(evec.T, vec)
-    I = np.eye(evec.shape[0]).copy('F')
-
-    #csamplex.set_rwalk_seed(1 + id + samplex.random_seed)
-    csamplex.set_rwalk_seed(1 + seed)
-
-    log_time = time.clock()
-
-    #t0=0
-    #t1=time.clock()
-
-    offs = ' '*36
-    i = 0
-    j=0
-    while True:
-        j+= 1
-
-        #t0=time.clock()
-
-        put_immediate = False
-        done = False
-        try:
-            while not done:
-                #if 1:
-                cmd = cmdq.get()
-                if cmd[0] == 'CONT':
-                    break
-#                   if lclq:
-#                       q.put([id,lclq])
-#                       lclq = []
-#                   else:
-#                       put_immediate = True
-                elif cmd[0] == 'NEW DATA':
-                    eval[:],evec[:],twiddle = cmd[1]
-                    eqs[:,1:] = np.dot(samplex.eqs[:,1:], evec)
-                    lclq = []
-                    i=0
-                elif cmd[0] == 'REQ TWIDDLE':
-                    ackq.put(twiddle)
-                elif cmd[0] == 'WAIT':
-                    ackq.put('OK')
-                elif cmd[0] == 'STOP':
-                    done = True
-                elif cmd[0] == 'RWALK':
-                    done = True
-                else:
-                    print 'Unknown cmd:', cmd
-        except QueueEmpty:
-            pass
-
-        if done:
-            break
-
-        while len(lclq) < 10:
-            vec[:] = np.dot(evec.T, vec)
-
-            #t1=time.clock()
-
-
-            accepted = False
-            while not accepted:
-                Naccepted = 0
-                Nrejected = 0
-
-                Naccepted,Nrejected,t = csamplex.rwalk(samplex, eqs, vec,eval,S,S0, twiddle, Naccepted,Nrejected)
-
-                r = Naccepted / (Naccepted + Nrejected)
-
-                #-------------------------------------------------------------------
-                # If the actual acceptance rate was OK then leave this loop,
-                # otherwise change our step size twiddle factor to improve the rate.
-                # Even if the accepance rate was OK, we adjust the twiddle but only
-                # with a certain probability. This drives the acceptance rate to 
-                # the specified one even if we are within the tolerance but doesn't
-                # throw away the results if we are not so close. This allows for
-                # a larger tolerance.
-                #-------------------------------------------------------------------
-                accepted =  np.abs(r - samplex.accept_rate) < samplex.accept_rate_tol
-
-                state = 'B'
-                if not accepted:
-                    twiddle *= 1 + ((r-samplex.accept_rate) / samplex.accept_rate / 2)
-                    #twiddle *= (r/samplex.accept_rate)
-                    twiddle = max(1e-14,twiddle)
-                    state = 'R' + state
-
-                if time.clock() - log_time > 3:
-                    msg = 'THREAD %3i]  %i/%i  %4.1f%% accepted  (%6i/%6i Acc/Rej)  twiddle %5.2f  time %5.3fs backlog %i' % (id, i, burnin_len, 100*r, Naccepted, Nrejected, twiddle, t, len(lclq))
-                    Log( offs + '% 2s %s' % (state, msg), overwritable=True )
-                    log_time = time.clock()
-
-                #print ' '*36, '% 2s %s' % (state, msg)
-
-            #print 'thread %i, %f' % (id,t1-t0)
-
-            vec[:] = np.dot(evec, vec)
-
-            if random() < np.abs(r - samplex.accept_rate)/samplex.accept_rate_tol:
-                twiddle *= 1 + ((r-samplex.accept_rate) / samplex.accept_rate / 2)
-                #twiddle *= (r/samplex.accept_rate)
-                twiddle = max(1e-14,twiddle)
-
-            assert np.all(vec >= 0), vec[vec < 0]
-            #if np.any(vec < 0): sys.exit(0)
-
-            samplex.project(vec)
-
-            i += 1
-#           if put_immediate:
-#               q.put([id,[vec.copy('A')]])
-#           else:
-            lclq.append(vec.copy('A'))
-
-        q.put([id,lclq,'BURNIN'])
-        lclq = []
-
-
-
-    time_begin = time.clock()
-    if cmd[0] == 'RWALK':
-        rwalk(id, nmodels, samplex, q, cmdq, vec, twiddle, eval, evec, seed=None)
-    time_end = time.clock()
-
-    cmd = cmdq.get()
-    assert cmd[0] == 'STOP', cmd[0]
-    ackq.put(['TIME', time_end-time_begin])
-
-    #print ' '*39, 'RWALK THREAD %i LEAVING  n_stored=%i  time=%.4fs' % (id,i,time_end-time_begin)
-
-def rwalk(id, nmodels, samplex, q, cmdq, vec,twiddle, eval,evec,seed):
-
-    S   = np.zeros(samplex.eqs.shape[0])
-    S0  = np.zeros(samplex.eqs.shape[0])
-
-    vec  = vec.copy('A')
-    eqs  = samplex.eqs.copy('A')
-
-    accepted = 0
-    rejected = 0
-
-    offs = ' '*39
-    Log( offs + 'STARTING rwalk THREAD %i [this thread makes %i models]' % (id,nmodels), overwritable=True)
+EQS_ALIGN = 64
+
+def aligned_zeros(shape, align=EQS_ALIGN):
+    ''' Return a C-ordered float64 array of zeros whose data starts on an
+        align-byte boundary. '''
+    nbytes = int(np.prod(shape)) * 8
+    buf = np.zeros(nbytes + align, dtype=np.uint8)
+    offs = (-buf.ctypes.data) % align
+    return buf[offs:offs+nbytes].view(np.float64).reshape(shape)
+
+def transposed_eqs(samplex, evec, out=None):
+    ''' Rotate the constraint matrix samplex.eqs into the eigenbasis evec and
+        return its transpose. Each row of the result is one column of the
+        rotated constraints, padded so that every row is 64-byte aligned.
+        This lets csamplex.rwalk_many read an eigen-direction as a contiguous
+        vector. The leq rows are negated so that every inequality has the
+        form S >= 0. '''
+    eqs = samplex.eqs
+    rows = eqs.shape[0]
+    if out is None:
+        ld = rows + (-rows % (EQS_ALIGN // 8))
+        out = aligned_zeros((eqs.shape[1], ld))
+    out[0,:rows]  = eqs[:,0]
+    out[1:,:rows] = np.dot(evec.T, eqs[:,1:].T)
+
+    leq = slice(samplex.eq_count, samplex.eq_count + samplex.leq_count)
+    out[:,leq] *= -1
+    return out
+
+class Walkers:
+    ''' A set of random walkers that advance together, one native thread per
+        walker, in csamplex.rwalk_many. All walkers share a single rotated
+        copy of the constraint matrix. Each walker keeps its own position,
+        step size (twiddle), and random number state. '''
+
+    def __init__(self, samplex, nwalkers, vec, twiddle, eval, evec, seed):
+        self.samplex  = samplex
+        self.vecs     = np.tile(vec, (nwalkers,1))
+        self.twiddles = np.empty(nwalkers, dtype=np.float64)
+        self.twiddles[:] = twiddle
+        self.S        = np.zeros((nwalkers, samplex.eqs.shape[0]), order='C', dtype=np.float64)
 
-    eqs[:,1:] = np.dot(samplex.eqs[:,1:], evec)
-
-    #csamplex.set_rwalk_seed(1 + id + samplex.random_seed)
-    if seed is not None: csamplex.set_rwalk_seed(1 + seed)
-
-    log_time = time.clock()
-
-    offs = ' '*36
-    state = ''
-    for i in xrange(nmodels):
-
-        accepted = 0
-        rejected = 0
-
-        done = False
-
-        vec[:] = np.dot(evec.T, vec)
-        accepted,rejected,t = csamplex.rwalk(samplex, eqs, vec,eval,S,S0, twiddle, accepted,rejected)
-        vec[:] = np.dot(evec, vec)
-
-        r = accepted / (accepted + rejected)
-
-        if time.clock() - log_time > 3:
-            Log( offs + '% 2s THREAD %3i  %i  %4.1f%% accepted  (%6i/%6i Acc/Rej)  twiddle %5.2f  time %5.3fs  %i left.' % (state, id, i, 100*r, accepted, rejected, twiddle, t, nmodels-i), overwritable=True )
-            log_time = time.clock()
-
-        #print ' '*36, '% 2s THREAD %3i  %i  %4.1f%% accepted  (%6i/%6i Acc/Rej)  twiddle %5.2f  time %5.3fs  %i left.' % (state, id, i, 100*r, accepted, rejected, twiddle, t, nmodels-i)
-        assert np.all(vec >= 0), vec[vec < 0]
-        #if numpy.any(vec < 0): sys.exit(0)
-
-        samplex.project(vec)
-
-        q.put([id,vec.copy('A'),'RWALK'])
+        #-----------------------------------------------------------------------
+        # Walker k draws from stream k of seed, independently of how the
+        # walkers are scheduled.
+        #-----------------------------------------------------------------------
+        self.rng = np.zeros((nwalkers, csamplex.RNG_STATE_SIZE), order='C', dtype=np.uint8)
+        csamplex.seed_rng(self.rng, seed)
+
+        self.eqs = None
+        self.set_basis(eval, evec)
+
+    def __len__(self):
+        return len(self.vecs)
+
+    def set_basis(self, eval, evec):
+        self.eval = eval.copy('A')
+        self.evec = np.asfortranarray(evec).copy('F')
+        self.eqs  = transposed_eqs(self.samplex, self.evec, out=self.eqs)
+
+    def walk(self, nsamples=1):
+        ''' Have every walker take nsamples samples, samplex.redo steps apart.
+            The samples come back already in the original basis and projected
+            onto the equality constraints, as an array of shape
+            (walkers, nsamples, dim). Also returns the acceptance rate of each
+            walker and the CPU time used. '''
+        accepted = np.zeros(len(self), dtype=np.int64)
+        rejected = np.zeros(len(self), dtype=np.int64)
+        samples  = np.empty((len(self), nsamples, self.vecs.shape[1]), order='C', dtype=np.float64)
+
+        t,nnegative = csamplex.rwalk_many(self.samplex, self.eqs, self.vecs, self.eval, self.evec, self.S, 
+                                          self.twiddles, self.rng, accepted, rejected, samples)
+        assert nnegative == 0, '%i negative coordinates' % nnegative
+
+        return accepted / (accepted + rejected), t, samples
+
+    def tune(self, r):
+        ''' Adjust the twiddle of each walker given its acceptance rate r and
+            return which walkers were within the acceptance tolerance.
+
+            If the actual acceptance rate was not OK the twiddle is changed to
+            improve the rate. Even if the accepance rate was OK, we adjust the
+            twiddle but only with a certain probability. This drives the
+            acceptance rate to the specified one even if we are within the
+            tolerance but doesn't throw away the results if we are not so
+            close. This allows for a larger tolerance.
+
+            With hit-and-run every step is accepted and there is no step size
+            to tune. '''
+        s = self.samplex
+        if s.hit_and_run:
+            return np.ones(len(self), dtype=bool)
+
+        d = r - s.accept_rate
+        ok = np.abs(d) < s.accept_rate_tol
+        adjust = ~ok | (random(len(self)) < np.abs(d) / s.accept_rate_tol)
+
+        self.twiddles[adjust] *= 1 + (d[adjust] / s.accept_rate / 2)
+        np.maximum(self.twiddles, 1e-14, out=self.twiddles)
+
+        return ok
 
 class Samplex:
     INFEASIBLE, FEASIBLE, NOPIVOT, FOUND_PIVOT, UNBOUNDED = range(5)
@@ -278,6 +181,10 @@ class Samplex:
         self.redo_exp           = kw.get('redo exp', 2)
         self.twiddle            = kw.get('twiddle', 2.4)
         self.burnin_factor = kw.get('burnin factor', 10)
+        self.step_mode          = kw.get('step mode', 'gaussian')
+
+        assert self.step_mode in ['gaussian', 'hit_and_run'], 'Unknown step mode %s' % self.step_mode
+        self.hit_and_run = self.step_mode == 'hit_and_run'
 
         assert ncols is not None
         self.nVars = ncols
@@ -294,7 +201,6 @@ class Samplex:
         self.geq_count = 0
 
         self.eq_list = []
-        self.ineqs = []
 
         self.avg0 = None
 
@@ -409,6 +315,7 @@ class Samplex:
         Log( 'Using lpsolve %s' % lpsolve('lp_solve_version') )
         Log( "random seed = %s" % self.random_seed )
         Log( "threads = %s" % self.nthreads )
+        Log( "step mode = %s" % self.step_mode )
         Log( "acceptence rate = %s" % self.accept_rate )
         Log( "acceptence rate tolerance = %s" % self.accept_rate_tol )
         Log( "dof = %s" % self.dof)
@@ -429,7 +336,7 @@ class Samplex:
             for i,[c,e] in enumerate(self.eq_list[:self.eq_count]):
                 self.A[i] = e[1:]
                 self.b[i] = e[0]
-            self.Apinv = pinv(self.A)
+            self.Apinv = np.ascontiguousarray(pinv(self.A))
             P -= np.dot(self.Apinv, self.A)
         else:
             self.A = None
@@ -476,8 +383,6 @@ class Samplex:
         store[:,0] = newp
         n_stored = 1
 
-        q = MP.Queue()
-
         #-----------------------------------------------------------------------
         # Estimate the eigenvectors of the simplex
         #-----------------------------------------------------------------------
@@ -493,80 +398,43 @@ class Samplex:
         Log( "Getting solutions" )
 
         ran_set_seed(self.random_seed)
-        seeds = np.random.choice(1000000*nthreads, nthreads, replace=False)
 
         #-----------------------------------------------------------------------
-        # Launch the threads
+        # Create the walkers. Each one runs in its own native thread.
         #-----------------------------------------------------------------------
-        threads = []
-        models_per_thread = nmodels // nthreads
-        models_under      = nmodels - nthreads*models_per_thread
-        id,N = 0,0
-        while id < nthreads and N < nmodels:
-            n = models_per_thread
-            if id < models_under:
-                n += 1
-            assert n > 0
-            Log( 'Thread %i gets %i' % (id,n) )
-            cmdq = MP.Queue()
-            ackq = MP.Queue()
-
-            thr = MP.Process(target=rwalk_burnin, 
-                             args=(id, n, int(np.ceil(burnin_len/nthreads)), self, q, cmdq, ackq, newp, self.twiddle, eval.copy('A'), evec.copy('A'), seeds[id]))
-            threads.append([thr,cmdq,ackq])
-            N += n
-            id += 1
-
-        assert N == nmodels
-
-        for thr,cmdq,_ in threads:
-            thr.daemon=True
-            thr.start()
-            cmdq.put(['CONT'])
-
-        def drainq(q):
-            try:
-                while True:
-                    q.get(block=False)
-            except QueueEmpty:
-                pass
-
-        def pause_threads(threads):
-            for _,cmdq,ackq in threads:
-                cmdq.put(['WAIT'])
-                assert ackq.get() == 'OK'
-
-        def adjust_threads(i, cont_cmd):
-            pause_threads(threads)
-            drainq(q)
+        nwalkers = max(1, min(nthreads, nmodels))
+        walkers = Walkers(self, nwalkers, newp, self.twiddle, eval, evec, self.random_seed)
+        Log( '%i walkers' % nwalkers )
+
+        time_walkers = 0
+
+        def adjust_walkers(i):
             Log( 'Computing eigenvalues... [%i/%i]' % (i, burnin_len) )
             self.compute_eval_evec(store, eval, evec, n_stored)
 
             # new twiddle <-- average twiddle
-            t = 0
-            for _,cmdq,ackq in threads:
-                cmdq.put(['REQ TWIDDLE'])
-                t += ackq.get()
-            t /= len(threads)
-
-            Log( 'New twiddle %f' % t )
-            for _,cmdq,_ in threads:
-                cmdq.put(['NEW DATA', [eval.copy('A'), evec.copy('A'), t]])
-                cmdq.put([cont_cmd])
+            walkers.twiddles[:] = np.mean(walkers.twiddles)
+            Log( 'New twiddle %f' % walkers.twiddles[0] )
+            walkers.set_basis(eval, evec)
 
         #-----------------------------------------------------------------------
         # Burn-in
         #-----------------------------------------------------------------------
         time_begin_burnin = time.clock()
+        log_time = time.clock()
         compute_eval_window = 2 * self.dof
         j = 0
-        k = -1
         while n_stored < burnin_len+1:
-            #for i in xrange(burnin_len):
-            k,vecs,phase = q.get()
+            r,t,samples = walkers.walk()
+            time_walkers += t
+            ok = walkers.tune(r)
+
+            if time.clock() - log_time > 3:
+                Log( ' '*36 + 'B  %i/%i  %4.1f%% accepted  twiddle %5.2f  time %5.3fs' 
+                    % (n_stored, burnin_len, 100*np.mean(r), np.mean(walkers.twiddles), t), overwritable=True )
+                log_time = time.clock()
 
-            #print 'Received ', len(vecs), ' from ', k
-            for vec in vecs:
+            for vec in samples[ok,0]:
                 j += 1
                 store[:, n_stored] = vec
                 n_stored += 1
@@ -574,48 +442,34 @@ class Samplex:
 
                 if j == compute_eval_window:
                     j = 0
-                    adjust_threads(i+1,'CONT')
+                    adjust_walkers(n_stored)
                     compute_eval_window = int(0.1*burnin_len + 1)
                     break
 
-            if j != 0 and len(threads) < compute_eval_window:
-                threads[k][1].put(['CONT'])
-
         time_end_burnin = time.clock()
 
         #-----------------------------------------------------------------------
         # Actual random walk
         #-----------------------------------------------------------------------
         time_begin_get_models = time.clock()
-        adjust_threads(burnin_len, 'RWALK')
+        adjust_walkers(burnin_len)
         i=0
         while i < nmodels:
-            k,vec,phase = q.get()
-            if phase != 'RWALK': continue
-            t = np.zeros(dim+1, order='Fortran', dtype=np.float64)
-            t[1:] = vec
-            i += 1
-            Log( '%i models left to generate' % (nmodels-i), overwritable=True)
-            yield t
+            nsamples = min(10, int(np.ceil((nmodels-i) / nwalkers)))
+            r,t,samples = walkers.walk(nsamples)
+            time_walkers += t
+            samples = samples.transpose(1,0,2).reshape(-1, dim)
+            for vec in samples[:nmodels-i]:
+                t = np.zeros(dim+1, order='Fortran', dtype=np.float64)
+                t[1:] = vec
+                i += 1
+                Log( '%i models left to generate' % (nmodels-i), overwritable=True)
+                yield t
 
         time_end_get_models = time.clock()
 
-        #-----------------------------------------------------------------------
-        # Stop the threads and get their running times.
-        #-----------------------------------------------------------------------
-        time_threads = []
-        for thr,cmdq,ackq in threads:
-            cmdq.put(['STOP'])
-            m,t = ackq.get()
-            assert m == 'TIME'
-            time_threads.append(t)
-            #thr.terminate()
-
         time_end_next = time.clock()
 
-        max_time_threads = np.amax(time_threads) if time_threads else 0
-        avg_time_threads = np.mean(time_threads) if time_threads else 0
-
         Log( '-'*80 )
         Log( 'SAMPLEX TIMINGS' )
         Log( '-'*80 )
@@ -623,7 +477,7 @@ class Samplex:
         Log( 'Estimate eigenvectors  %.2fs' % (time_end_est_eigenvectors - time_begin_est_eigenvectors) )
         Log( 'Burn-in                %.2fs' % (time_end_burnin - time_begin_burnin) )
         Log( 'Modeling               %.2fs' % (time_end_get_models - time_begin_get_models) )
-        Log( 'Max/Avg thread time    %.2fs %.2fs' % (max_time_threads, avg_time_threads) )
+        Log( 'Walker CPU time        %.2fs' % time_walkers )
         Log( 'Total wall-clock time  %.2fs' % (time_end_next - time_begin_next) )
         Log( '-'*80 )
 
@@ -802,7 +656,5 @@ class Samplex:
 
     def leq(self, a):
         self.leq_count += 1
-
-        self.ineqs.append([-a[1:], GE, a[0]])
         self.eq_list.append(['leq', a])
 
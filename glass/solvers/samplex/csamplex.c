@@ -36,9 +36,29 @@
 /* thread reallocate a bit of the table memory. This puts the memory        */
 /* that each thread will be working with local to the CPU. This yields a    */
 /* 2x overall speed up.                                                     */
+/*                                                                          */
+/* SET_THREAD_AFFINITY only compiles in support for pinning the workers.    */
+/* Whether they are pinned is chosen at run time by the solver's            */
+/* 'pin threads' option, which is off by default.                           */
 /*==========================================================================*/
 #define REORGANIZE_TABLE_MEMORY 0
-#define SET_THREAD_AFFINITY     0
+#define SET_THREAD_AFFINITY     1
+
+/*==========================================================================*/
+/* A pivot is only a few microseconds of work, so the pool threads spin at  */
+/* the barrier before falling back to sleeping on a condition variable.     */
+/* Each thread adapts its own spin count between these limits. Columns are  */
+/* handed out in chunks of PIVOT_CHUNK so idle threads can steal work.      */
+/*==========================================================================*/
+#define SPIN_MIN    (1<<6)
+#define SPIN_MAX    (1<<16)
+#define PIVOT_CHUNK 16
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
 
 #define WITH_GOOGLE_PROFILER 0
 
@@ -116,6 +136,29 @@ enum
     UNBOUNDED      = 4,
 };
 
+/*==========================================================================*/
+/* Pricing rules. These must match Samplex.PRICE_* in samplex.py.           */
+/*                                                                          */
+/* PRICE_FULL runs the ratio test on every improving column and takes the   */
+/* largest increase of the objective function.                              */
+/*                                                                          */
+/* PRICE_PARTIAL and PRICE_DEVEX only score the columns during the pivot.   */
+/* select_pivot then scans a window of at least PRICE_WINDOW columns,       */
+/* starting where the last scan stopped, and runs the ratio test on the     */
+/* best PRICE_CANDIDATES of them. Partial pricing scores a column by its    */
+/* reduced cost; devex divides the squared reduced cost by a reference      */
+/* weight that is updated with every pivot.                                 */
+/*==========================================================================*/
+enum 
+{
+    PRICE_FULL     = 0,
+    PRICE_PARTIAL  = 1,
+    PRICE_DEVEX    = 2,
+};
+
+#define PRICE_CANDIDATES 8
+#define PRICE_WINDOW     64
+
 inline int32_t min(int32_t a, int32_t b)
 {
     return (a < b) ? a : b;
@@ -149,6 +192,13 @@ long total_alloc = 0;
 /*==========================================================================*/
 /* Data structures for the table and arrays.                                */
 /*==========================================================================*/
+typedef struct
+{
+    int32_t l;                  /* Pivot row, 0 if no candidate, -1 if unbounded */
+    dble_t piv, inc;
+    dble_t score;               /* Pricing score, > 0 for improving columns */
+} price_t;
+
 typedef struct
 {
     uint32_t cols;
@@ -156,23 +206,37 @@ typedef struct
     dble_t * restrict orig;
     dble_t * restrict data;
     dble_t * restrict pcol;
+    int32_t pcol_lo, pcol_hi;   /* First and last nonzero row of pcol */
+    int32_t * restrict col;     /* Slot in data of each column */
+    price_t * restrict price;   /* Ratio test result of each column */
+    dble_t * restrict weight;   /* Devex reference weight of each column */
+    int32_t pricing;            /* One of PRICE_* */
 } matrix_t __attribute__ ((aligned(8)));
 
+/*==========================================================================*/
+/* Column r of the tableau. Removing a column only shifts col[] and the     */
+/* other per-column arrays down, so columns keep their order without the    */
+/* table itself being moved. The slots stay in increasing order.           */
+/*==========================================================================*/
+#define COL(tabl, r) ((tabl)->data + (tabl)->col[r] * (tabl)->rows)
+
 typedef struct pivot_thread_s
 {
     pthread_t thr_id;
 
     int32_t id;
     int32_t start, end;
+    int32_t next;                   // Next unclaimed column in [start,end)
+    int32_t sense;                  // Local barrier sense
+    int32_t spin;                   // Current barrier spin count
+    int32_t pinned;                 // Pinned to its own CPU
 
     matrix_t * restrict tabl;
     dble_t * restrict pcol;
 
     long L;
-    dble_t piv, inc, coef;
+    dble_t piv, wq;
     int32_t lpiv, rpiv;
-    int32_t *left, *right;
-    int32_t res;
 
     void (*action)(struct pivot_thread_s *thr);
 
@@ -182,14 +246,16 @@ typedef struct
 {
     int32_t total_threads;          // Total number of threads
     int32_t nthreads;               // Number of usable threads 
-    int32_t active_threads;         // Number of threads currently executing doPivot
     int32_t threads_initialized;
+    int32_t pin_threads;            // Pin worker i to the i-th allowed CPU
     pivot_thread_t *thr;
+    int32_t barrier_count __attribute__ ((aligned(64)));  // Threads yet to arrive
+    int32_t barrier_sense;          // Flipped by the last thread to arrive
+    int32_t sleepers;               // Threads blocked on wakeup
     pthread_mutex_t lock;
-    pthread_cond_t activate_all;
-    pthread_cond_t thread_finished;
+    pthread_cond_t wakeup;
 } thread_pool_t;
-#define EMPTY_POOL {0,0,0,0,NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER}
+#define EMPTY_POOL {0,0,0,0,NULL,0,0,0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER}
 
 typedef struct
 {
@@ -216,6 +282,9 @@ static int32_t need_assign_pivot_threads;
 
 PyObject *samplex_pivot(PyObject *self, PyObject *args);
 void doPivot(pivot_thread_t *thr);
+void doPrice(pivot_thread_t *thr);
+void price_columns(pivot_thread_t *thr, int32_t start, int32_t end);
+void pivot_columns(pivot_thread_t *thr, int32_t start, int32_t end);
 void doPivot0(matrix_t * restrict tabl,
     dble_t * restrict pcol,
     const long L,
@@ -246,7 +315,11 @@ void pivot_thread_init(pivot_thread_t *pt, int32_t id)
     pt->tabl   = NULL;
     pt->pcol   = NULL;
     pt->start  = 
-    pt->end    = 0;
+    pt->end    = 
+    pt->next   = 0;
+    pt->sense  = 0;
+    pt->spin   = SPIN_MIN;
+    pt->pinned = 0;
     pt->action = doPivot;
 }
 
@@ -262,48 +335,118 @@ void pivot_thread_reset(pivot_thread_t *pt, int32_t start, int32_t end)
     }
 }
 
-void *pivot_thread_run(void *arg)
+/*==========================================================================*/
+/* Sense-reversing barrier over all pool threads, including the main one.   */
+/* The last thread to arrive flips the global sense and releases the rest.  */
+/* Waiters spin for a while and then sleep. A thread whose wait ended while */
+/* spinning spins longer next time; one that had to sleep spins less.       */
+/*==========================================================================*/
+static void pool_barrier(pivot_thread_t *pt)
 {
-    pivot_thread_t *pt = (pivot_thread_t *)arg;
+    int32_t i;
+    const int32_t sense = pt->sense = !pt->sense;
+
+    if (__atomic_sub_fetch(&pool.barrier_count, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        __atomic_store_n(&pool.barrier_count, pool.total_threads, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool.barrier_sense, sense, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&pool.sleepers, __ATOMIC_SEQ_CST))
+        {
+            pthread_mutex_lock(&pool.lock);
+            pthread_cond_broadcast(&pool.wakeup);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        return;
+    }
+
+    for (i=0; i < pt->spin; i++)
+    {
+        if (__atomic_load_n(&pool.barrier_sense, __ATOMIC_ACQUIRE) == sense)
+        {
+            if (pt->spin < SPIN_MAX) pt->spin *= 2;
+            return;
+        }
+        CPU_RELAX();
+    }
+
+    if (pt->spin > SPIN_MIN) pt->spin /= 2;
+
+    pthread_mutex_lock(&pool.lock);
+    __atomic_add_fetch(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool.barrier_sense, __ATOMIC_SEQ_CST) != sense)
+        pthread_cond_wait(&pool.wakeup, &pool.lock);
+    __atomic_sub_fetch(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool.lock);
+}
 
 #if SET_THREAD_AFFINITY
-    cpu_set_t mask;
+/*==========================================================================*/
+/* Pin worker i to the i-th CPU this process may run on, or let it run on   */
+/* any of them again. Neighbouring CPU numbers normally share a socket, so  */
+/* the pool stays on as few NUMA nodes as possible. The main thread belongs */
+/* to Python and is left alone, so its mask is the set of allowed CPUs.     */
+/*==========================================================================*/
+static void pin_thread(pivot_thread_t *pt, int32_t pin)
+{
+    cpu_set_t allowed, mask;
+    int32_t cpu_to_use = -1;
 
-    int32_t ncpus      = sysconf(_SC_NPROCESSORS_CONF);
-    int32_t cpu_to_use = pt->id % ncpus;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
 
-    /* Try to fix the thread to a single CPU */
+    if (pin)
+    {
+        int32_t n = pt->id % CPU_COUNT(&allowed);
+        for (cpu_to_use=0; cpu_to_use < CPU_SETSIZE; cpu_to_use++)
+            if (CPU_ISSET(cpu_to_use, &allowed) && n-- == 0) break;
 
-    CPU_ZERO(&mask);
-    CPU_SET(cpu_to_use, &mask);
+        CPU_ZERO(&mask);
+        CPU_SET(cpu_to_use, &mask);
+    }
+    else
+    {
+        mask = allowed;
+    }
 
-    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0)
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
     {
         int32_t e = errno;
         fprintf(stderr, "Thread %i: %s\n", pt->id, strerror(e));
     }
     else DBG(2)
     {
-        pthread_getaffinity_np(pthread_self(), sizeof(mask), &mask);
-        fprintf(stderr, "Thread %i on CPU%d\n", pt->id, cpu_to_use);
+        if (pin) fprintf(stderr, "Thread %i on CPU%d\n", pt->id, cpu_to_use);
+        else     fprintf(stderr, "Thread %i unpinned\n", pt->id);
     }
+
+    pt->pinned = pin;
+}
 #endif
 
+void *pivot_thread_run(void *arg)
+{
+    pivot_thread_t *pt = (pivot_thread_t *)arg;
+
     while (1)
     {
-        pthread_mutex_lock(&pool.lock);
-        pool.active_threads--;
-        assert(pool.active_threads >= 0);
-        DBG(1) fprintf(stderr, "THREAD %i done at=%i\n", pt->id, pool.active_threads);
+        pool_barrier(pt);
 
-        pthread_cond_signal(&pool.thread_finished);
-        pthread_cond_wait(&pool.activate_all, &pool.lock);
+#if SET_THREAD_AFFINITY
+        //----------------------------------------------------------------------
+        // The option is read on every call to pivot(), so follow it here.
+        //----------------------------------------------------------------------
+        if (pt->pinned != pool.pin_threads)
+            pin_thread(pt, pool.pin_threads);
+#endif
 
         DBG(1) fprintf(stderr, "THREAD %i starting\n", pt->id);
-        pthread_mutex_unlock(&pool.lock);
 
         if (pt->action)
             pt->action(pt);
+
+        DBG(1) fprintf(stderr, "THREAD %i done\n", pt->id);
+
+        pool_barrier(pt);
     }
 
     return NULL;
@@ -311,27 +454,27 @@ void *pivot_thread_run(void *arg)
 
 static inline void startup_threads()
 {
-    pthread_mutex_lock(&pool.lock);
-    pool.active_threads = pool.total_threads-1;
-    pthread_cond_broadcast(&pool.activate_all);
-    pthread_mutex_unlock(&pool.lock);
+    pool_barrier(&pool.thr[0]);
 }
 
 static inline void wait_for_threads()
 {
-    pthread_mutex_lock(&pool.lock);
-    while (pool.active_threads != 0)
-        pthread_cond_wait(&pool.thread_finished, &pool.lock);
-    pthread_mutex_unlock(&pool.lock);
+    pool_barrier(&pool.thr[0]);
 }
 
 /*==========================================================================*/
 /* initPivotThreads                                                         */
 /*==========================================================================*/
-void init_threads(int32_t n) 
+void init_threads(int32_t n, int32_t pin) 
 {
     int32_t i;
 
+    //--------------------------------------------------------------------------
+    // The pool is only built once, but the workers pick up a change of the
+    // pinning option at the start of the next pivot.
+    //--------------------------------------------------------------------------
+    pool.pin_threads = pin;
+
     if (pool.threads_initialized) return;
 
     DBG(1) fprintf(stderr, "> initPivotThreads() nthreads=%i\n", n);
@@ -343,21 +486,9 @@ void init_threads(int32_t n)
 
     pool.nthreads       = n;
     pool.total_threads  = n;
-    pool.active_threads = 0;
-
-#if SET_THREAD_AFFINITY
-    if (n > 0)
-    {
-        /* The main thread runs on the first CPU */
-        cpu_set_t mask;
-        sched_getaffinity(0, sizeof(mask), &mask);
-        CPU_ZERO(&mask);
-        CPU_SET(0, &mask);
-        if (sched_setaffinity(0, sizeof(mask), &mask) < 0)
-            fprintf(stderr, "%s\n", strerror(errno));
-        sched_getaffinity(0, sizeof(mask), &mask);
-    }
-#endif
+    pool.barrier_count  = n;
+    pool.barrier_sense  = 0;
+    pool.sleepers       = 0;
 
     //--------------------------------------------------------------------------
     // Create the worker threads
@@ -365,18 +496,16 @@ void init_threads(int32_t n)
     pool.thr = CALLOC(pivot_thread_t, pool.total_threads); assert(pool.thr != NULL);
 
     //--------------------------------------------------------------------------
-    // Notice we start from 1 not 0, because we handle the first thread
-    // specially later on. 
+    // Notice we start from 1 not 0, because the first thread is the caller.
+    // The workers go straight to the barrier and wait for the first pivot.
     //--------------------------------------------------------------------------
-    pool.active_threads = pool.total_threads-1;
+    pivot_thread_init(&pool.thr[0], 0);
     for (i=1; i < pool.total_threads; i++)
     {
         pivot_thread_init(&pool.thr[i], i);
         pthread_create(&pool.thr[i].thr_id, &attr, pivot_thread_run, (void *)&pool.thr[i]);
     }
 
-    wait_for_threads();
-    assert(pool.active_threads == 0);
     pool.threads_initialized = 1;
 
     need_assign_pivot_threads = 1;
@@ -398,281 +527,236 @@ void init_threads(int32_t n)
 //gives no pivot, the function is unbounded.
 
 /*==========================================================================*/
-/* choosePivot                                                              */
+/* price_column                                                             */
+/*                                                                          */
+/* The ratio test for column r against the current constant column. This   */
+/* does not depend on any other column, so the pool threads run it for      */
+/* their own columns straight after pivoting them, while the column is      */
+/* still in cache. select_pivot then only has to compare the results.      */
 /*==========================================================================*/
-
-int32_t choose_pivot0(matrix_t *tabl, int32_t *left, int32_t *right, long L,
-                      int32_t *lpiv0, int32_t *rpiv0, dble_t *piv0, dble_t *inc0, dble_t *coef0, int32_t *res0,
-                      int start, int end)
+static inline void price_column(matrix_t *tabl, long L, int32_t r)
 { 
-    int32_t k, r;
-    dble_t * restrict bcol = &tabl->data[0];
+    int32_t k;
+    const dble_t * restrict bcol = COL(tabl, 0);
+    const dble_t * restrict col  = COL(tabl, r);
+    price_t *p = &tabl->price[r];
 
-    int32_t res = NOPIVOT; 
-    dble_t coef = 0,
-           inc  = 0;
+    p->l = 0;
+    if (col[0] <= 0) return;
 
-    int32_t rpivq = 0,
-            lpiv  = 0,
-            rpiv  = 0;
-
-    dble_t piv = 0;
-
-    DBG(3) fprintf(stderr, "> choosePivot()\n");
-
-    for (r = start; r < end; r++)
-    {
-        const dble_t * restrict col = &tabl->data[r * tabl->rows + 0];
-
-        DBG(2) fprintf(stderr, "r=%i\n", r);
-
-        //fprintf(stderr, "rq=%i, r=%i, ivo=%f, coef=%f  %i\n", rq, r, ivo, coef,ivo>coef);
+    //--------------------------------------------------------------------------
+    // We now look for the column entry that causes the objective function
+    // to increase the most.  Set |l,cpiv,cinc| for candidate pivot
+    //--------------------------------------------------------------------------
+    int32_t l     = 0;
+    dble_t  cpiv  = 0,
+            cinc  = 0;
+    for (k=1; k <= L; k++) 
+    { 
+        if (col[k] >= -SML) continue; /* only interested in negative values */
 
-        if (col[0] <= coef) continue;
-        //if (col[0] <= 0) continue;
+        const dble_t tinc = -bcol[k] * col[0]/col[k];
 
-        //----------------------------------------------------------------------
-        // Assume we will find a pivot element.
-        //----------------------------------------------------------------------
-        res = FOUND_PIVOT;
+        DBG(1) assert(!isinf(tinc));
 
         //----------------------------------------------------------------------
-        // We now look for the column entry that causes the objective function
-        // to increase the most.  Set |l,cleft,cpiv,cinc| for candidate pivot
+        // Accept this pivot element if we haven't found anything yet.
         //----------------------------------------------------------------------
-        int32_t l     = 0,
-                cleft = 0; 
-        dble_t cpiv  = 0,
-               cinc  = 0;
-        for (k=1; k <= L; k++) 
-        { 
-            //fprintf(stderr, "0\n");
-            //if (col[k] == 0) continue;
+        if (l != 0 && !(tinc < cinc)) continue;
 
-            //===========================================================
-            //===========================================================
+        l     = k; 
+        cpiv  = col[k]; 
+        cinc  = tinc;
+    }
 
+    //--------------------------------------------------------------------------
+    // No row limits the increase.
+    //--------------------------------------------------------------------------
+    if (l == 0) { p->l = -1; return; }
 
-            if (col[k] >= -SML) continue; /* only interested in negative values */
+    p->l   = l;
+    p->piv = cpiv;
+    p->inc = cinc;
+}
 
-            const dble_t tinc = -bcol[k] * col[0]/col[k];
-            //const dble_t tinc = -bcol[k] * col[0]/col[k];
-#if 0
-            DBG(1) fprintf(stderr, "col[0]=%f\n", col[0]);
-            DBG(1) fprintf(stderr, "bcol[k=%i]=%f\n", k, bcol[k]);
-            DBG(1) fprintf(stderr, "col[k=%i]=%f\n", k, col[k]);
-            DBG(1) fprintf(stderr, "*** tinc=%f\n", tinc);
-            DBG(1) fprintf(stderr, "*** cinc=%f\n", cinc);
-            //fprintf(stderr, "*** tinc-cinc=%f\n", ABS(tinc-cinc));
-            //fprintf(stderr, "*** tinc-cinc=%f\n", ABS(tinc-cinc));
-            //fprintf(stderr, "*** tinc-cinc=%i\n", ABS(tinc-cinc)<EPS);
-#endif
+/*==========================================================================*/
+/* score_column                                                             */
+/*                                                                          */
+/* The cheap part of partial and devex pricing. No ratio test here.         */
+/*==========================================================================*/
+static inline void score_column(matrix_t *tabl, int32_t r)
+{
+    const dble_t c0 = COL(tabl, r)[0];
+    price_t *p = &tabl->price[r];
 
-            DBG(1) assert(!isinf(tinc));
+    if (c0 <= 0)
+        p->score = 0;
+    else if (tabl->pricing == PRICE_DEVEX)
+        p->score = c0 * c0 / tabl->weight[r];
+    else
+        p->score = c0;
+}
 
-            //------------------------------------------------------------------
-            // Accept this pivot element if we haven't found anything yet.
-            //------------------------------------------------------------------
-            int32_t accept = 0;
-            if (l==0) 
-            {
-                accept = 1;
-            }
-#if 0
-            else if (ABS(tinc-cinc) < EPS) 
-            { 
-                if (left[k] > 0 && cleft > 0)  
-                    accept = (left[k] > cleft) + 2;
-                else 
-                    accept = (left[k] < cleft) + 4;
-            }
-#endif
-            else 
-            {
-                accept = (tinc < cinc) + 8;
-            }
+void price_columns(pivot_thread_t *thr, int32_t start, int32_t end)
+{
+    int32_t r;
+    if (thr->tabl->pricing == PRICE_FULL)
+        for (r=start; r < end; r++) price_column(thr->tabl, thr->L, r);
+    else
+        for (r=start; r < end; r++) score_column(thr->tabl, r);
+}
 
-            if ((accept&1)==0) continue; // && tinc > 0)
-            //assert(tinc > 0);
+/*==========================================================================*/
+/* consider_pivot                                                           */
+/*                                                                          */
+/* Apply the pivot rule to column r, whose ratio test is in tabl->price.    */
+/* Columns must be offered in increasing order. Returns 0 if the column     */
+/* shows the problem to be unbounded.                                       */
+/*==========================================================================*/
+typedef struct
+{
+    int32_t res;
+    int32_t rpivq, lpiv, rpiv;
+    dble_t piv, inc, coef;
+} pivot_choice_t;
+#define EMPTY_CHOICE {NOPIVOT, 0,0,0, 0,0,0}
 
-            DBG(2) fprintf(stderr, "ACCEPTING tinc=%.15e %i\n", tinc, accept);
+static inline int32_t consider_pivot(matrix_t *tabl, int32_t *right, int32_t r, pivot_choice_t *pc)
+{
+    const dble_t   c0 = COL(tabl, r)[0];
+    const price_t *p  = &tabl->price[r];
 
-            //------------------------------------------------------------------
-            // Remeber this pivot element for later.
-            //------------------------------------------------------------------
-            l = k; 
-            cleft = left[k]; 
-            cpiv  = col[k]; 
-            cinc  = tinc;
-        }
+    if (c0 <= pc->coef) return 1;
 
-        //----------------------------------------------------------------------
-        // Maybe update |lpiv,rpiv,rpivq,piv,inc,coef|
-        //----------------------------------------------------------------------
-        if (l == 0) 
-        {
-            lpiv = -1;
-            rpiv = -1;
-            piv  = -1;
-            res = UNBOUNDED;
-            break;
-        }
+    //--------------------------------------------------------------------------
+    // Assume we will find a pivot element.
+    //--------------------------------------------------------------------------
+    pc->res = FOUND_PIVOT;
 
-        //fprintf(stderr, "* r=%i lpiv=%i cinc=%f inc=%f right[r]=%i rpivq=%i\n", r,lpiv,cinc, inc, right[r], rpivq);
-        int32_t accept = 0;
-        if (lpiv==0)
-            accept = 1;
-        else if (ABS(cinc-inc) < EPS)
-            accept = (right[r] < rpivq);
-        else  
-            accept = (cinc > inc);
+    if (p->l == -1) 
+    {
+        pc->lpiv = -1;
+        pc->rpiv = -1;
+        pc->piv  = -1;
+        pc->res  = UNBOUNDED;
+        return 0;
+    }
 
-        if (!accept) continue;
+    //--------------------------------------------------------------------------
+    // Maybe update |lpiv,rpiv,rpivq,piv,inc,coef|
+    //--------------------------------------------------------------------------
+    int32_t accept = 0;
+    if (pc->lpiv==0)
+        accept = 1;
+    else if (ABS(p->inc-pc->inc) < EPS)
+        accept = (right[r] < pc->rpivq);
+    else  
+        accept = (p->inc > pc->inc);
 
-        lpiv  = l;    
-        rpiv  = r; 
+    if (!accept) return 1;
 
-        rpivq = right[r];
+    pc->lpiv  = p->l;    
+    pc->rpiv  = r; 
 
-        piv = cpiv; 
-        inc = cinc; 
-        
-        coef = col[0];
+    pc->rpivq = right[r];
 
-        //break; // Bland's Rule: Take the first one you find.
-    }
+    pc->piv  = p->piv; 
+    pc->inc  = p->inc; 
+    pc->coef = c0;
 
-    DBG(2) fprintf(stderr, "< choosePivot() %i %i %e %e\n", lpiv, rpiv, piv, inc);
-
-    *lpiv0 = lpiv;
-    *rpiv0 = rpiv;
-    *piv0  =  piv;
-    *inc0  =  inc;
-    *coef0 = coef;
-    *res0  = res;
-    return res;
+    return 1;
 }
 
-void choose_pivot(pivot_thread_t *thr)
-{
-    if (thr->start == thr->end) return;
-
-    choose_pivot0(thr->tabl,
-                  thr->left,
-                  thr->right,
-                  thr->L,
-                 &thr->lpiv,
-                 &thr->rpiv,
-                 &thr->piv,
-                 &thr->inc,
-                 &thr->coef,
-                 &thr->res,
-                  thr->start,
-                  thr->end);
-}
+/*==========================================================================*/
+/* select_pivot_partial                                                     */
+/*                                                                          */
+/* Keep the best PRICE_CANDIDATES columns by score, sorted by column so     */
+/* consider_pivot sees them in order. Only those get a ratio test. The scan */
+/* continues past the window until at least one improving column is found, */
+/* so NOPIVOT still means that no column can improve the objective.         */
+/*==========================================================================*/
+static int32_t price_cursor = 1;
 
-int32_t select_pivot(matrix_t *tabl, int32_t *left, int32_t *right, long L, long R,
-                     int32_t *lpiv0, int32_t *rpiv0, dble_t *piv0)
+static void select_pivot_partial(matrix_t *tabl, int32_t *right, long L, long R, pivot_choice_t *pc)
 {
-#if 1
-
-    int32_t start = pool.thr[0].start,
-            end   = pool.thr[0].end;
-
-    pool.thr[0].start = 1;
-    pool.thr[0].end   = R+1;
-    pool.thr[0].tabl   = tabl;
-    pool.thr[0].left   = left;
-    pool.thr[0].right  = right;
-    pool.thr[0].L      = L;
-    pool.thr[0].piv    = 0;
-    pool.thr[0].lpiv   = 0;
-    pool.thr[0].rpiv   = 0;
-    pool.thr[0].inc    = 0;
-    pool.thr[0].coef   = 0;
-    pool.thr[0].res    = NOPIVOT;
-    choose_pivot(&pool.thr[0]);
-
-    *lpiv0 = pool.thr[0].lpiv;    
-    *rpiv0 = pool.thr[0].rpiv; 
-    *piv0  = pool.thr[0].piv; 
-
-    pool.thr[0].start = start;
-    pool.thr[0].end   = end;
-
-    return pool.thr[0].res;
-#else
+    int32_t i, j, n, r;
+    int32_t cand[PRICE_CANDIDATES];
+    int32_t ncand = 0;
 
-    int i;
-    for (i=0; i < pool.nthreads; i++)
-    {
-        pool.thr[i].tabl   = tabl;
-        pool.thr[i].left   = left;
-        pool.thr[i].right  = right;
-        pool.thr[i].L      = L;
-        pool.thr[i].piv    = 0;
-        pool.thr[i].lpiv   = 0;
-        pool.thr[i].rpiv   = 0;
-        pool.thr[i].inc    = 0;
-        pool.thr[i].coef   = 0;
-        pool.thr[i].res    = NOPIVOT;
-        pool.thr[i].action = choose_pivot;
-    }
-
-    startup_threads();
-    pool.thr[0].start += 1;
-    choose_pivot(&pool.thr[0]);
-    pool.thr[0].start -= 1;
-    wait_for_threads();
-
-    int32_t rpivq = 0,
-            lpiv  = 0,
-            rpiv  = 0;
+    if (price_cursor > R) price_cursor = 1;
 
-    dble_t piv = 0, inc=0, coef=0;
-    int32_t res = NOPIVOT;
-
-    for (i=0; i < pool.nthreads; i++)
+    for (n=0, r=price_cursor; n < R; n++, r = (r == R) ? 1 : r+1)
     {
-        //fprintf(stderr, "thr %i start=%i end=%i coef=%f\n", pool.thr[i].id, pool.thr[i].start, pool.thr[i].end, pool.thr[i].coef);
+        if (n >= PRICE_WINDOW && ncand != 0) break;
 
-        if (pool.thr[i].lpiv == 0) continue;
-        if (pool.thr[i].lpiv == -1) return UNBOUNDED;
+        const dble_t score = tabl->price[r].score;
+        if (score <= 0) continue;
 
-        if (pool.thr[i].coef <= coef) continue;
-
-        res = FOUND_PIVOT;
+        //----------------------------------------------------------------------
+        // Find the weakest candidate, and replace it if this one is better.
+        //----------------------------------------------------------------------
+        if (ncand < PRICE_CANDIDATES)
+        {
+            cand[ncand++] = r;
+        }
+        else
+        {
+            for (j=0, i=1; i < ncand; i++)
+                if (tabl->price[cand[i]].score < tabl->price[cand[j]].score) j = i;
 
-        int32_t accept = 0;
+            if (score <= tabl->price[cand[j]].score) continue;
+            cand[j] = r;
+        }
+    }
+    price_cursor = r;
 
-        if (lpiv == 0)
-            accept = 1;
-        else if (ABS(pool.thr[i].inc-inc) < EPS)
-            accept = (pool.thr[i].right[pool.thr[i].rpiv] < rpivq);
-        else  
-            accept = (pool.thr[i].inc > inc);
+    //--------------------------------------------------------------------------
+    // Insertion sort by column, then run the ratio tests.
+    //--------------------------------------------------------------------------
+    for (i=1; i < ncand; i++)
+        for (j=i; j > 0 && cand[j-1] > cand[j]; j--)
+        {
+            int32_t t = cand[j]; cand[j] = cand[j-1]; cand[j-1] = t;
+        }
 
-        if (!accept) continue;
+    for (i=0; i < ncand; i++)
+    {
+        price_column(tabl, L, cand[i]);
+        if (!consider_pivot(tabl, right, cand[i], pc)) break;
+    }
+}
 
-        lpiv  = pool.thr[i].lpiv;    
-        rpiv  = pool.thr[i].rpiv; 
+/*==========================================================================*/
+/* select_pivot                                                             */
+/*                                                                          */
+/* With full pricing, scan the columns in order using the ratio tests       */
+/* already stored in tabl->price. This is the serial rule, so the choice    */
+/* does not depend on how many threads did the pricing.                     */
+/*==========================================================================*/
+int32_t select_pivot(matrix_t *tabl, int32_t *right, long L, long R,
+                     int32_t *lpiv0, int32_t *rpiv0, dble_t *piv0)
+{
+    int32_t r;
+    pivot_choice_t pc = EMPTY_CHOICE;
 
-        rpivq = pool.thr[i].right[pool.thr[i].rpiv];
+    DBG(3) fprintf(stderr, "> select_pivot()\n");
 
-        piv  = pool.thr[i].piv; 
-        inc  = pool.thr[i].inc; 
-        coef = pool.thr[i].coef;
+    if (tabl->pricing == PRICE_FULL)
+    {
+        for (r = 1; r < R+1; r++)
+            if (!consider_pivot(tabl, right, r, &pc)) break;
+    }
+    else
+    {
+        select_pivot_partial(tabl, right, L, R, &pc);
     }
 
-    //fprintf(stderr, "* %f\n", coef);
-
-    *lpiv0 = lpiv;
-    *rpiv0 = rpiv;
-    *piv0  =  piv;
-
-    return res;
-#endif
+    DBG(2) fprintf(stderr, "< select_pivot() %i %i %e %e\n", pc.lpiv, pc.rpiv, pc.piv, pc.inc);
 
+    *lpiv0 = pc.lpiv;
+    *rpiv0 = pc.rpiv;
+    *piv0  = pc.piv;
+    return pc.res;
 }
 
 void assign_threads(int32_t lo, int32_t hi)
@@ -723,6 +807,8 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
     long Z = PyInt_AsLong(PyObject_GetAttrString(o, "nTemp"));
 
     long T = PyInt_AsLong(PyObject_GetAttrString(o, "nthreads"));
+    long P = PyInt_AsLong(PyObject_GetAttrString(o, "pricing"));
+    long A = PyObject_IsTrue(PyObject_GetAttrString(o, "pin_threads"));
 
 #if 0
     fprintf(stderr, "%ld %ld // %ld %ld\n", PyArray_DIM(data,0), PyArray_DIM(data,1),
@@ -765,7 +851,7 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
     long Zorig = Z;
 
 
-    init_threads(T); 
+    init_threads(T, A); 
     need_assign_pivot_threads = 1;
 
     /* Remember, this is in FORTRAN order */
@@ -814,7 +900,16 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
     tabl.cols = PyArray_DIM(data,1);
 #endif
 
-    tabl.pcol = malloc(tabl.rows * sizeof(*(tabl.data)));
+    tabl.pcol  = malloc(tabl.rows * sizeof(*(tabl.data)));
+    tabl.col   = MALLOC(int32_t, tabl.cols); assert(tabl.col != NULL);
+    for (i=0; i < tabl.cols; i++) tabl.col[i] = i;
+    tabl.price = MALLOC(price_t, tabl.cols); assert(tabl.price != NULL);
+
+    tabl.pricing = P;
+    assert(PRICE_FULL <= tabl.pricing && tabl.pricing <= PRICE_DEVEX);
+
+    tabl.weight = MALLOC(dble_t, tabl.cols); assert(tabl.weight != NULL);
+    for (i=0; i < tabl.cols; i++) tabl.weight[i] = 1;
 
 #if WITH_GOOGLE_PROFILER
     ProfilerStart("googperf.out");
@@ -834,6 +929,23 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
 
     Py_BEGIN_ALLOW_THREADS
 
+    //--------------------------------------------------------------------------
+    // The objective row may have changed since the last call, so price every
+    // column once. After this the pivots keep the prices up to date.
+    //--------------------------------------------------------------------------
+    assign_threads(1,R); 
+    for (i=0; i < pool.nthreads; i++)
+    {
+        pool.thr[i].tabl   = &tabl;
+        pool.thr[i].L      = L;
+        pool.thr[i].next   = pool.thr[i].start;
+        pool.thr[i].action = doPrice;
+    }
+
+    startup_threads();
+    doPrice(&pool.thr[0]);
+    wait_for_threads();
+
     for (n=0;; n++)
     {
         report.step     = n;
@@ -898,9 +1010,9 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
 
         //if (n == 5) exit(0);
 
-        if (need_assign_pivot_threads) assign_threads(0,R); 
+        if (need_assign_pivot_threads) assign_threads(1,R); 
 
-        ret = select_pivot(&tabl, left, right, L, R, &lpiv, &rpiv, &piv);
+        ret = select_pivot(&tabl, right, L, R, &lpiv, &rpiv, &piv);
 
         if (ret != FOUND_PIVOT) break;
 
@@ -917,7 +1029,28 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
         // In any event, we do at least one pivot operation in this thread.
         //==================================================================
 
-        memcpy(tabl.pcol, tabl.data + (rpiv*tabl.rows), tabl.rows * sizeof(*(tabl.data)));
+        memcpy(tabl.pcol, COL(&tabl, rpiv), tabl.rows * sizeof(*(tabl.data)));
+
+        //------------------------------------------------------------------
+        // The constraints are sparse. Rows outside the nonzero range of the
+        // pivot column are left unchanged by the pivot, so don't visit them.
+        //------------------------------------------------------------------
+        for (tabl.pcol_lo=0; tabl.pcol_lo < L && tabl.pcol[tabl.pcol_lo] == 0; tabl.pcol_lo++) {}
+        for (tabl.pcol_hi=L; tabl.pcol_hi > tabl.pcol_lo && tabl.pcol[tabl.pcol_hi] == 0; tabl.pcol_hi--) {}
+
+        //------------------------------------------------------------------
+        // Every column's ratio test reads the constant column, so it has to
+        // be pivoted before the threads start. The threads then pivot and
+        // price the remaining columns in one sweep.
+        //------------------------------------------------------------------
+        doPivot0(&tabl, tabl.pcol, L, piv, lpiv, rpiv, 0, 1);
+
+        const dble_t wq = tabl.weight[rpiv];
+        if (tabl.pricing == PRICE_DEVEX)
+        {
+            tabl.weight[rpiv] = wq / (piv*piv);
+            if (tabl.weight[rpiv] < 1) tabl.weight[rpiv] = 1;
+        }
 
         for (i=0; i < pool.nthreads; i++)
         {
@@ -926,6 +1059,8 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
             pool.thr[i].piv    = piv;
             pool.thr[i].lpiv   = lpiv;
             pool.thr[i].rpiv   = rpiv;
+            pool.thr[i].wq     = wq;
+            pool.thr[i].next   = pool.thr[i].start;
             pool.thr[i].action = doPivot;
         }
 
@@ -946,15 +1081,22 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
         if (lq < 0)
         { 
             //------------------------------------------------------------------
-            // Remove the pivot column
+            // Remove the pivot column. The pivot rule scans the columns in
+            // order, so the order is kept, but only the per-column arrays are
+            // shifted. The table is compacted once when we return.
             //------------------------------------------------------------------
             memmove(right+rpiv+0, 
                     right+rpiv+1, 
                     sizeof(*right)*(R-rpiv)); /* (R+1)-(rpiv+1) */
-
-            memmove(tabl.data + (rpiv+0)*tabl.rows, 
-                    tabl.data + (rpiv+1)*tabl.rows,
-                    sizeof(*tabl.data) * (R-rpiv)*tabl.rows);
+            memmove(tabl.col+rpiv+0, 
+                    tabl.col+rpiv+1, 
+                    sizeof(*tabl.col)*(R-rpiv));
+            memmove(tabl.price+rpiv+0, 
+                    tabl.price+rpiv+1, 
+                    sizeof(*tabl.price)*(R-rpiv));
+            memmove(tabl.weight+rpiv+0, 
+                    tabl.weight+rpiv+1, 
+                    sizeof(*tabl.weight)*(R-rpiv));
 
             Z--; 
             R--;
@@ -967,7 +1109,7 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
         {
             for (i=0; i <= R; i++)
             {
-                dble_t *col = &(tabl.data[i * tabl.rows + 0]);
+                dble_t *col = COL(&tabl, i);
                 for (j=0; j <= L; j++)
                     if (ABS(ABS(col[j]) - 22.00601215427127) < 1e-3)
                     {
@@ -1001,7 +1143,19 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
     fprintf(stderr, "\rtime: %4.2f CPU seconds. %39c\n", (etime-stime), ' ');
     //fprintf(stderr, "time: %f\n", (etime-stime) / pool.nthreads);
 
+    //--------------------------------------------------------------------------
+    // Move the columns that are left back into their own slots for Python.
+    // The slots only increase, so copying forward never overwrites a column
+    // that is still to be moved.
+    //--------------------------------------------------------------------------
+    for (i=1; i <= R; i++)
+        if (tabl.col[i] != i)
+            memcpy(tabl.data + i*tabl.rows, COL(&tabl, i), sizeof(*tabl.data) * tabl.rows);
+
     free(tabl.pcol);
+    free(tabl.col);
+    free(tabl.price);
+    free(tabl.weight);
 
     Py_END_ALLOW_THREADS
 
@@ -1024,30 +1178,91 @@ PyObject *samplex_pivot(PyObject *self, PyObject *args)
 /* Now the code to do the pivoting.  An artificial variable that leaves     */
 /* is removed.  If we are removing the last of these, we set |conv=true|.   */
 /*==========================================================================*/
-void doPivot(pivot_thread_t *thr)
+/*==========================================================================*/
+/* steal_columns                                                            */
+/*                                                                          */
+/* Apply fn to chunks of columns. Each thread works through its own columns */
+/* first and then steals chunks from the other threads. Columns whose       */
+/* pivot-row entry is zero cost almost nothing, so an even split of the     */
+/* columns is not an even split of the work.                                */
+/*==========================================================================*/
+static inline void steal_columns(pivot_thread_t *thr, 
+                                 void (*fn)(pivot_thread_t *thr, int32_t start, int32_t end))
+{
+    int32_t i, c;
+
+    if (thr->id >= pool.nthreads) return;
+
+    for (i=0; i < pool.nthreads; i++)
+    {
+        pivot_thread_t *victim = pool.thr + (thr->id + i) % pool.nthreads;
+
+        while ((c = __atomic_fetch_add(&victim->next, PIVOT_CHUNK, __ATOMIC_RELAXED)) < victim->end)
+            fn(thr, c, min(c + PIVOT_CHUNK, victim->end));
+    }
+}
+
+/*==========================================================================*/
+/* pivot_columns                                                            */
+/*                                                                          */
+/* Pivot each column and redo its ratio test while it is still in cache.    */
+/*==========================================================================*/
+void pivot_columns(pivot_thread_t *thr, int32_t start, int32_t end)
 {
-    if (thr->start == thr->end) return;
+    int32_t r;
+
+#if REORGANIZE_TABLE_MEMORY
+    const dble_t * restrict pcol = thr->pcol;
+#else
+    const dble_t * restrict pcol = thr->tabl->pcol;
+#endif
+
+    matrix_t * restrict tabl = thr->tabl;
+
+    for (r=start; r < end; r++)
+    {
+        //----------------------------------------------------------------------
+        // Devex: w_r = max(w_r, (a_r/a_q)^2 w_q) with a the pivot row. The
+        // weight of the pivot column itself was set before the sweep.
+        //----------------------------------------------------------------------
+        if (tabl->pricing == PRICE_DEVEX && r != thr->rpiv)
+        {
+            const dble_t a = COL(tabl, r)[thr->lpiv] / thr->piv;
+            const dble_t w = a * a * thr->wq;
+            if (w > tabl->weight[r]) tabl->weight[r] = w;
+        }
 
+        doPivot0(thr->tabl, 
+                 pcol,
+                 thr->L, 
+                 thr->piv, 
+                 thr->lpiv, 
+                 thr->rpiv, 
+                 r, 
+                 r+1);
+
+        if (tabl->pricing == PRICE_FULL)
+            price_column(tabl, thr->L, r);
+        else
+            score_column(tabl, r);
+    }
+}
 
+void doPivot(pivot_thread_t *thr)
+{
 #if REORGANIZE_TABLE_MEMORY
     if (thr->pcol == NULL)
         thr->pcol = malloc(thr->tabl->rows * sizeof(*(thr->tabl->data)));
 
     memcpy(thr->pcol, thr->tabl->pcol, thr->tabl->rows * sizeof(*(thr->tabl->data)));
-    const dble_t * restrict pcol = thr->pcol;
-#else
-    const dble_t * restrict pcol = thr->tabl->pcol;
 #endif
 
+    steal_columns(thr, pivot_columns);
+}
 
-    doPivot0(thr->tabl, 
-             pcol,
-             thr->L, 
-             thr->piv, 
-             thr->lpiv, 
-             thr->rpiv, 
-             thr->start, 
-             thr->end);
+void doPrice(pivot_thread_t *thr)
+{
+    steal_columns(thr, price_columns);
 }
 
 void copymem(pivot_thread_t *thr)
@@ -1141,21 +1356,27 @@ inline void in(const int32_t r,
 }
 #endif
 
+//------------------------------------------------------------------------------
+// Pivot column r. A column with a zero in the pivot row has a zero multiplier
+// and is left untouched. Otherwise only the rows in the nonzero range of pcol
+// can change.
+//------------------------------------------------------------------------------
 #define IN \
 do { \
     int32_t i;     \
-    dble_t * restrict col = tabl->data + (r * tabl->rows); \
+    dble_t * restrict col = COL(tabl, r); \
     const dble_t col_lpiv = col[lpiv];     \
+    if (col_lpiv == 0) break; \
     const dble_t xx = col_lpiv / piv;  \
     {  \
         if (ABS(xx) >= SML)    \
         {\
-            for (i=0; i <= L; i++) \
+            for (i=lo; i <= hi; i++) \
                 col[i] -= pcol[i] * xx;  \
         }\
         else   \
         {\
-            for (i=0; i <= L; i++) \
+            for (i=lo; i <= hi; i++) \
                 col[i] -= (pcol[i] * col_lpiv) / piv;   \
         }\
     }  \
@@ -1165,7 +1386,7 @@ do { \
 #define XIN \
 do { \
     int32_t i;     \
-    dble_t * restrict col = tabl->data + (r * tabl->rows); \
+    dble_t * restrict col = COL(tabl, r); \
     dble_t * restrict col1 = col; \
     dble_t * restrict pcol1 = pcol; \
     const dble_t col_lpiv = col[lpiv];     \
@@ -1200,12 +1421,15 @@ void doPivot0(
     int32_t r=start;
     int32_t i;
 
+    const int32_t lo = tabl->pcol_lo,
+                  hi = tabl->pcol_hi;
+
     if (start <= rpiv && rpiv < end)
     {
         for (r=start; r < rpiv; ++r) IN;
 
-        dble_t * restrict pcol0 = tabl->data + (rpiv * tabl->rows);
-        for (i=0; i <= L; i++)
+        dble_t * restrict pcol0 = COL(tabl, rpiv);
+        for (i=lo; i <= hi; i++)
             pcol0[i] /= piv;
         pcol0[lpiv] = 1.0 / piv;
 
@@ -1213,26 +1437,7 @@ void doPivot0(
     }
     else
     {
-        for (r=start; r < end; ++r)
-            do { 
-                int32_t i;     
-                dble_t * restrict col = tabl->data + (r * tabl->rows); 
-                const dble_t col_lpiv = col[lpiv];     
-                const dble_t xx = col_lpiv / piv;  
-                {  
-                    if (ABS(xx) >= SML)    
-                    {
-                        for (i=0; i <= L; i++) 
-                            col[i] -= pcol[i] * xx;  
-                    }
-                    else   
-                    {
-                        for (i=0; i <= L; i++) 
-                            col[i] -= (pcol[i] * col_lpiv) / piv;   
-                    }
-                }  
-                col[lpiv] = -xx;   
-            } while(0);
+        for (r=start; r < end; ++r) IN;
     }
 
     DBG(2)
@@ -1240,12 +1445,12 @@ void doPivot0(
         int32_t i,j;
         for (i=1; i <= L; i++)
         {
-            double v0 = tabl->data[0 * tabl->rows + i];
+            double v0 = COL(tabl, 0)[i];
             if (v0 == 0)
             {
                 for (j=1; j < end; j++)
                 {
-                    double v1 = tabl->data[j * tabl->rows + i];
+                    double v1 = COL(tabl, j)[i];
                     if (v1 == 0)
                     {
                         fprintf(stderr, "ACK %i %i\n", i, j);
@@ -21,3 +21,12 @@ def samplex_add_noise(env, n=1e-6):
 @command
 def samplex_reset(env, n=True):
     env.model_gen_options['reset'] = n
+
+@command
+def samplex_pricing(env, type='full'):
+    assert type in ['full', 'partial', 'devex']
+    env.model_gen_options['pricing'] = type
+
+@command
+def samplex_pin_threads(env, pin=True):
+    env.model_gen_options['pin threads'] = pin
@@ -5,8 +5,8 @@ import gc
 from numpy import isfortran, asfortranarray, sign, logical_and, any
 from numpy import set_printoptions
 from numpy import insert, zeros, vstack, append, hstack, array, all, sum, ones, delete, log, empty, dot, sqrt, arange
-from numpy import argwhere, argmin, inf, isinf, amin
-from numpy import histogram, logspace, flatnonzero, isinf
+from numpy import argwhere, argmin, argmax, inf, isinf, amin, outer, abs as npabs
+from numpy import histogram, logspace, flatnonzero, isinf, ix_
 from numpy.random import randint, random, normal, random_integers, seed as ran_set_seed
 #from glrandom import random, ran_set_seed
 
@@ -17,10 +17,10 @@ if 0:
     from pylab import figimage, show, imshow, hist, matshow, figure
 
 from log import log as Log
+from glass.solvers.sparse_row import SparseRow
 
 import csamplex
 
-from copy import deepcopy
 
 set_printoptions(linewidth=10000000, precision=20, threshold=2000)
 
@@ -36,13 +36,45 @@ class SamplexUnexpectedError:
     def __init__(self, msg=""):
         pass
 
-class SamplexSolution:
-    def __init__(self):
-        self.lhv = None # Array positions of left hand variables
-        self.loc = None # The n-dimenional coordinates
+class SamplexSolution(object):
+    """A point in the solution space. Vertices only keep the values of the
+       basic variables; loc is expanded when it is asked for."""
+    def __init__(self, lhv=None, vals=None, n=None, loc=None):
+        self.lhv  = lhv  # Array positions of left hand variables
+        self.vals = vals # Objective value followed by the basic variable values
+        self.n    = n    # Length of loc
+        self._loc = loc  # The n-dimenional coordinates, if stored densely
+
+    @property
+    def loc(self):
+        if self._loc is not None: return self._loc
+        loc = zeros(self.n, dtype=self.vals.dtype)
+        loc[self.lhv[1:]] = self.vals[1:]
+        loc[0] = self.vals[0]
+        return loc
+
+    def copy(self):
+        """A dense copy whose coordinates can be changed."""
+        return SamplexSolution(self.lhv, None, self.n, self.loc.copy())
+
+class BasisSnapshot(SamplexSolution):
+    """A vertex together with the order of the right hand variables and the
+       sizes needed to rebuild its tableau with Samplex.restore()."""
+    def __init__(self, s):
+        SamplexSolution.__init__(self, lhv  = s.lhv.copy(),
+                                       vals = s.data[0:s.nLeft+1,0].copy(),
+                                       n    = s.nVars+s.nSlack+1)
+        self.rhv    = s.rhv[:s.nRight+1].copy()
+        self.nVars  = s.nVars
+        self.nLeft  = s.nLeft
+        self.nSlack = s.nSlack
+        self.nTemp  = s.nTemp
+        self.nRight = s.nRight
 
 class Samplex:
     INFEASIBLE, FEASIBLE, NOPIVOT, FOUND_PIVOT, UNBOUNDED = range(5)
+    PRICE_FULL, PRICE_PARTIAL, PRICE_DEVEX = range(3)
+    pricing_choices = ['full', 'partial', 'devex']
     SML = 1e-6
     EPS = 1e-14
 
@@ -55,6 +87,10 @@ class Samplex:
         self.sol_type  = kw.get('solution type', 'interior')
         self.noise   = kw.get('add noise', 1e-6)
         self.reset   = kw.get('reset', False)
+        self.pricing_choice = kw.get('pricing', 'full')
+        assert self.pricing_choice in self.pricing_choices, 'Unknown pricing %s' % self.pricing_choice
+        self.pricing = self.pricing_choices.index(self.pricing_choice)
+        self.pin_threads = kw.get('pin threads', False)
 
         Log( "Samplex created" )
         Log( "    ncols = %i" % ncols )
@@ -69,7 +105,7 @@ class Samplex:
         Samplex.pivot = lambda s: csamplex.pivot(s)
 
         self.data = None
-        self.dcopy = []
+        self.ref = None
 
         self.n_equations = 0
         self.lhv = []
@@ -84,6 +120,7 @@ class Samplex:
         self.geq_count = 0
 
         self.eq_list = []
+        self.constraints = []        # [kind, row] as placed in the tableau
 
         self.iteration = 0
         self.moca = None
@@ -112,22 +149,15 @@ class Samplex:
         Log( "threads = %s" % self.nthreads )
         Log( "solution type = %s" % self.sol_type )
         Log( "with noise = %s" % self.noise )
+        Log( "pricing = %s" % self.pricing_choice )
+        Log( "pin threads = %s" % self.pin_threads )
 
         Log( "N = %i" % self.nVars )
         Log( "L = %i" % self.nLeft )
         Log( "R = %i" % self.nRight )
         Log( "S = %i" % self.nSlack )
-        self.data = zeros((self.nLeft+1, self.nRight+1), order='Fortran', dtype=numpy.float64)
-
-        self.nLeft = 0
-        self.nSlack = 0
-        self.nTemp = 0
-        self.nRight = self.nVars
-
-        # Tag the first element because we shouldn't be using it.
-        #self.lhv = [numpy.nan]  # numpy on MacOSX doesn't like this
-        self.lhv = [999999]
-        self.rhv = range(self.nVars+1)
+        self.new_tableau(self.nLeft, self.nRight)
+        self.constraints = []
 
         self.geq_count = 0
         self.leq_count = 0
@@ -217,6 +247,21 @@ class Samplex:
 #       #imshow(d.T)
 #       show()
 
+    def new_tableau(self, L, R):
+        """Allocate an empty tableau for L constraints and R right hand
+           variables. The rows are added with place_row()."""
+        self.data = zeros((L+1, R+1), order='Fortran', dtype=numpy.float64)
+
+        self.nLeft = 0
+        self.nSlack = 0
+        self.nTemp = 0
+        self.nRight = self.nVars
+
+        # Tag the first element because we shouldn't be using it.
+        #self.lhv = [numpy.nan]  # numpy on MacOSX doesn't like this
+        self.lhv = [999999]
+        self.rhv = range(self.nVars+1)
+
     def status(self, force=False):
         if force or self.iteration & 15 == 0:
             Log( "model %i]  iter % 5i  obj-val %f" % (self.n_solutions+1, self.iteration, self.data[0,0]) )
@@ -232,20 +277,13 @@ class Samplex:
 
 
         self.curr_sol = self.package_solution()                
-        self.moca     = deepcopy(self.curr_sol)
+        self.moca     = self.curr_sol.copy()
         #self.moca     = self.curr_sol.loc.copy()
 
         #p = self.curr_sol.loc[:self.nVars+1].copy()
         #yield p
 
-        self.dcopy = [self.data.copy('F'),
-                      self.lhv.copy(),
-                      self.rhv.copy(),
-                      self.nVars,
-                      self.nLeft,
-                      self.nSlack,
-                      self.nTemp,
-                      self.nRight]
+        self.ref      = self.snapshot()
 
         #yield self.curr_sol.loc[0:self.nVars+1]
 
@@ -266,6 +304,13 @@ class Samplex:
             self.B = []
 
             for i in range(5):
+                #-------------------------------------------------------------
+                # With reset, every trail after the first starts again from
+                # a vertex already found instead of the last one.
+                #-------------------------------------------------------------
+                if self.reset and i > 0:
+                    starts = [self.ref] + self.sol_list
+                    self.restore(starts[randint(len(starts))])
                 self.next_solution_trail()
 
             self.sum_ln_k = 0
@@ -324,14 +369,7 @@ class Samplex:
                 yield p
 
                 if self.reset:
-                    self.data   = self.dcopy[0].copy('F')
-                    self.lhv    = self.dcopy[1].copy()
-                    self.rhv    = self.dcopy[2].copy()
-                    self.nVars  = self.dcopy[3]
-                    self.nLeft  = self.dcopy[4]
-                    self.nSlack = self.dcopy[5]
-                    self.nTemp  = self.dcopy[6]
-                    self.nRight = self.dcopy[7]
+                    self.restore(self.ref)
 
 #   def next_solution(self):
 
@@ -358,12 +396,12 @@ class Samplex:
             while True:
                 result = self.pivot()
                 if  result == self.NOPIVOT:   
-                    #self.sol_list.append(self.package_solution())
+                    self.sol_list.append(self.snapshot())
                     self.status(force=True)
                     break
                 elif result == self.FEASIBLE:  
                     if self.iteration % 10 == 0:
-                        self.sol_list.append(self.package_solution())
+                        self.sol_list.append(self.snapshot())
                 elif result == self.UNBOUNDED: raise SamplexUnboundedError()
                 else:
                     Log( result )
@@ -405,21 +443,91 @@ class Samplex:
 
 
     def package_solution(self):
-        s = SamplexSolution()
-        #print "***", self.nVars+self.nSlack+1
-        s.loc = zeros(self.nVars+self.nSlack+1, dtype=self.data.dtype)
-
         assert self.lhv.size == self.nLeft+1, '%i %i' % (self.lhv.size, self.nLeft+1)
-        s.lhv = self.lhv.copy()
-        s.loc[self.lhv[1:]] = self.data[1:self.nLeft+1,0]
-        s.loc[0] = self.data[0,0]
+        s = SamplexSolution(lhv  = self.lhv.copy(), 
+                            vals = self.data[0:self.nLeft+1,0].copy(), 
+                            n    = self.nVars+self.nSlack+1)
 
-        assert all(s.loc[1:] >= 0), ("Negative vertex coordinate!", s.loc[s.loc < 0])
+        assert all(s.vals[1:] >= 0), ("Negative vertex coordinate!", s.vals[s.vals < 0])
         #assert all(s.loc[1:] >= -self.SML), ("Negative vertex coordinate!", s.loc[s.loc < 0])
-        #s.loc[0] = self.data[0,0]
 
         return s
 
+    #=========================================================================
+
+    def snapshot(self):
+        """Return the current vertex and its basis."""
+        return BasisSnapshot(self)
+
+    def restore(self, snap):
+        """Rebuild the tableau for the vertex in snap from the constraints.
+           Each variable of the basis in snap that is not yet basic is
+           pivoted in against the row, of those whose variable must still
+           leave, with the largest pivot element. The objective row is not
+           meaningful afterwards; the caller is expected to set a new
+           objective."""
+
+        assert snap.nTemp == 0, 'Only feasible vertices can be restored.'
+
+        nleq = len([kind for kind,a in self.constraints if kind == 'leq'])
+        self.new_tableau(len(self.constraints), self.nVars + nleq)
+        for kind,a in self.constraints:
+            self.place_row(kind, a)
+        self.lhv = array(self.lhv, dtype=numpy.int32)
+        self.rhv = array(self.rhv, dtype=numpy.int32)
+
+        assert self.nLeft == snap.nLeft and self.nSlack == snap.nSlack
+
+        target  = set(snap.lhv[1:])
+        leaving = array([v not in target for v in self.lhv], dtype=bool)
+        leaving[0] = False
+
+        for v in snap.lhv[1:]:
+            r = flatnonzero(self.rhv == v)
+            if r.size == 0: continue
+            r = r[0]
+
+            rows = flatnonzero(leaving)
+            l = rows[argmax(npabs(self.data[rows, r]))]
+            assert abs(self.data[l,r]) > self.EPS, 'Singular basis'
+
+            self.pivot_at(l, r)
+            leaving[l] = False
+
+        #---------------------------------------------------------------------
+        # The artificial variables have all left and their columns are
+        # dropped. Rows and columns are put in the same order as in snap.
+        #---------------------------------------------------------------------
+        rpos = dict((v,i) for i,v in enumerate(self.rhv))
+        lpos = dict((v,i) for i,v in enumerate(self.lhv))
+        cols = [rpos[v] for v in snap.rhv]
+        rows = [0] + [lpos[v] for v in snap.lhv[1:]]
+        self.data = asfortranarray(self.data[ix_(rows, cols)])
+
+        self.lhv    = snap.lhv.copy()
+        self.rhv    = snap.rhv.copy()
+        self.nTemp  = 0
+        self.nRight = snap.nRight
+
+        err = npabs(self.data[1:,0] - snap.vals[1:]).max()
+        assert err <= self.SML * max(1, npabs(snap.vals[1:]).max()), 'Restored vertex is off by %e' % err
+
+    def pivot_at(self, lpiv, rpiv):
+        """Exchange left variable lpiv and right variable rpiv. This is the
+           same operation as the pivot in csamplex.c, but without choosing
+           the pivot."""
+        D    = self.data[:self.nLeft+1, :self.nRight+1]
+        piv  = D[lpiv, rpiv]
+        prow = D[lpiv].copy()
+        pcol = D[:, rpiv].copy()
+
+        D -= outer(pcol, prow / piv)
+        D[lpiv]       = -prow / piv
+        D[:, rpiv]    =  pcol / piv
+        D[lpiv, rpiv] =  1.0  / piv
+
+        self.lhv[lpiv], self.rhv[rpiv] = self.rhv[rpiv], self.lhv[lpiv]
+
     def start_new_objective(self, kind=2, last_r=-1):
 
         if kind==0:
@@ -516,18 +624,26 @@ class Samplex:
             self.data[0,:self.nRight+1] *= -1
             return
         elif 1:
-            #print "obj", obj
-            for r in xrange(self.nRight+1):
-                col = self.data[:,r]
-                n   = self.rhv[r]
-                #print '@', obj[n], n
-                col[0] = obj[n] if 0 <= n <= self.nVars+self.nSlack else 0
-                #col[0] = obj[n] if 0 <= n <= self.nVars else 0
-                for k in xrange(1, self.nLeft+1):
-                    n = self.lhv[k]
-                    #print obj[n]
-                    if 0 <= n <= self.nVars+self.nSlack:
-                        col[0] += col[k] * obj[n]
+            #-----------------------------------------------------------------
+            # Row 0 is the objective restricted to the right hand variables
+            # plus the objective weights of the left hand variables times
+            # their rows. Artificial variables (negative indices) have no
+            # weight. This is one matrix-vector product over the tableau.
+            #-----------------------------------------------------------------
+            nvs = self.nVars+self.nSlack
+            R1  = self.nRight+1
+            L1  = self.nLeft+1
+
+            def weights(vs):
+                w = zeros(len(vs), dtype=self.data.dtype)
+                ks = logical_and(0 <= vs, vs <= nvs)
+                w[ks] = obj[vs[ks]]
+                return w
+
+            lw = weights(self.lhv[1:L1])
+            rw = weights(self.rhv[:R1])
+
+            self.data[0,:R1] = rw + dot(lw, self.data[1:L1,:R1])
 
             #print '!' * 80
             #print 'objfn', self.data[0,:self.nRight+1]
@@ -673,8 +789,15 @@ class Samplex:
 
         #for i in sol.lhv: print sol.loc[i], self.moca[i]
 
-        iv    = sol.loc[sol.lhv[1:]]
-        dist  = iv - lip.loc[sol.lhv[1:]]
+        #---------------------------------------------------------------------
+        # sol may itself be an interior point, so every coordinate can limit
+        # the step, not only the basic variables of a vertex. For a vertex
+        # the others are zero and never do.
+        #---------------------------------------------------------------------
+        vars  = slice(1,self.nVars+self.nSlack+1)
+        sloc  = sol.loc
+        iv    = sloc[vars]
+        dist  = iv - lip.loc[vars]
         a = dist > 0
         #a = dist > self.SML
         if not any(a):
@@ -700,31 +823,36 @@ class Samplex:
 
         #old_moca = self.moca.copy()
 
-        vars = slice(1,self.nVars+self.nSlack+1)
         #self.moca[vars] = sol.loc[vars] + k * (self.moca[vars]-sol.loc[vars])
         #assert all(self.moca >= -self.SML), self.moca[self.moca < 0]
         #assert all(self.moca >= 0), (self.moca[self.moca < 0], self.moca)
         ##assert all(self.moca >= -self.SML), (self.moca[self.moca < 0], self.moca)
 
-        q = sol.loc[vars] + k * (lip.loc[vars]-sol.loc[vars])
+        q = sloc[vars] + k * (lip.loc[vars]-sloc[vars])
         w = q < 0
         if any(w):
             print '!! k,r,smallest_scale are ', k, r, smallest_scale
             print '!!', lip.loc[w]
             print '!!', argwhere(w)
             print 
-            print '!!', sol.loc[w]
+            print '!!', sloc[w]
             print '!!', q[w]
             assert 0
 
         k = smallest_scale 
 
-        q2 = deepcopy(lip)
-        q2.loc[vars] = sol.loc[vars] + k * lip.loc[vars] - k*sol.loc[vars]
+        q2 = lip.copy()
+        q2.loc[vars] = sloc[vars] + k * lip.loc[vars] - k*sloc[vars]
 
-        ip = deepcopy(lip)
+        # q2 lies on a facet, where the coordinate that should be zero can
+        # come out as a rounding error of either sign.
+        qv = q2.loc[vars]
+        w = qv < 0
+        assert all(qv[w] > -self.SML), (qv[w], argwhere(w))
+        qv[w] = 0
+
+        ip = lip.copy()
         ip.loc[vars] = q
-        s = deepcopy(ip)
         #return s.loc[:self.nVars+1]
         #print s
 
@@ -736,6 +864,8 @@ class Samplex:
     #=========================================================================
 
     def add_noise(self, a):
+        if a[0] == 0 and isinstance(a, SparseRow):
+            return a.perturbed(self.EPS, self.noise * random(1))
         if a[0] == 0: 
             w = abs(a) > self.EPS
             w[0] = True
@@ -807,12 +937,8 @@ class Samplex:
     def _eq(self, a): 
         if a[0] < 0: a *= -1
 
-        self.nLeft += 1
-        self.nTemp += 1
-
         self.eq_count += 1
-        self.lhv.append(-self.nTemp)
-        self.data[self.nLeft, 0:1+self.nVars] = a
+        self.add_row('eq', a)
 
     def _geq(self, a): 
         self.geq_count += 1
@@ -822,10 +948,7 @@ class Samplex:
             self._leq(a)
             self.leq_count -= 1
         else:
-            self.nLeft  += 1
-            self.nSlack += 1
-            self.lhv.append(self.nVars+self.nSlack)
-            self.data[self.nLeft, 0:1+self.nVars] = a
+            self.add_row('geq', a)
 
     def _leq(self, a): 
         self.leq_count += 1
@@ -833,6 +956,32 @@ class Samplex:
             a *= -1
             self._geq(a)
             self.geq_count -= 1
+        else:
+            self.add_row('leq', a)
+
+    def add_row(self, kind, a):
+        """Place the constraint row a and keep it so that restore() can
+           rebuild the tableau."""
+        self.constraints.append([kind, a])
+        self.place_row(kind, a)
+
+    def place_row(self, kind, a):
+        """Add the row a to the tableau. An 'eq' row gets an artificial
+           variable, a 'geq' row a slack variable and an 'leq' row an
+           artificial variable plus a slack variable column."""
+        if kind == 'eq':
+            self.nLeft += 1
+            self.nTemp += 1
+
+            self.lhv.append(-self.nTemp)
+            self.data[self.nLeft, 0:1+self.nVars] = a
+
+        elif kind == 'geq':
+            self.nLeft  += 1
+            self.nSlack += 1
+            self.lhv.append(self.nVars+self.nSlack)
+            self.data[self.nLeft, 0:1+self.nVars] = a
+
         else:
             self.nLeft += 1
             self.nSlack += 1
@@ -844,4 +993,3 @@ class Samplex:
 
             self.data[self.nLeft, 0:1+self.nVars] = a
             self.data[self.nLeft, self.nRight] = 1.0
-
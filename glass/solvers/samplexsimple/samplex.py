@@ -20,6 +20,8 @@ except ImportError:
         print x
     Log = l
 
+from glass.solvers.sparse_row import SparseRow
+
 import csamplex
 
 from copy import deepcopy
@@ -535,6 +537,8 @@ class Samplex:
     #=========================================================================
 
     def add_noise(self, a):
+        if a[0] == 0 and isinstance(a, SparseRow):
+            return a.perturbed(self.EPS, 10e-5 * random(1))
         if a[0] == 0: 
             w = abs(a) > self.EPS
             w[0] = True
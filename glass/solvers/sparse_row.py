@@ -0,0 +1,75 @@
+from __future__ import division
+import numpy as np
+
+class SparseRow(object):
+    """A constraint row a of length n, where a[0] is the constant term, stored
+       as sorted (indices, values) pairs.
+
+       Rows behave enough like numpy arrays for the solvers: a[0] and slices
+       can be read, a row can be negated or scaled in place, and numpy will
+       expand it through __array__ when a dense row is really needed."""
+
+    __slots__ = ['n', 'indices', 'values']
+
+    def __init__(self, n, indices, values):
+        indices = np.asarray(indices, dtype=np.int64)
+        values  = np.asarray(values,  dtype=np.float64)
+        order = np.argsort(indices, kind='mergesort')
+        self.n       = n
+        self.indices = indices[order]
+        self.values  = values[order]
+
+    @staticmethod
+    def from_dense(a, offs=1, n=None):
+        """Place the dense row a into a row of length n, with a[0] kept as
+           the constant and a[1:] starting at index offs."""
+        a  = np.asarray(a)
+        nz = np.flatnonzero(a)
+        if n is None: n = offs + len(a) - 1
+        return SparseRow(n, np.where(nz == 0, 0, nz - 1 + offs), a[nz])
+
+    def __len__(self):
+        return self.n
+
+    def __getitem__(self, k):
+        if isinstance(k, slice):
+            return self.toarray()[k]
+        if k < 0: k += self.n
+        i = np.searchsorted(self.indices, k)
+        if i < self.indices.size and self.indices[i] == k:
+            return self.values[i]
+        return 0.0
+
+    def __neg__(self):
+        return SparseRow(self.n, self.indices, -self.values)
+
+    def __imul__(self, s):
+        self.values *= s
+        return self
+
+    def copy(self):
+        return SparseRow(self.n, self.indices.copy(), self.values.copy())
+
+    def toarray(self, dtype=np.float64):
+        a = np.zeros(self.n, dtype=dtype)
+        a[self.indices] = self.values
+        return a
+
+    def __array__(self, dtype=None):
+        return self.toarray(np.float64 if dtype is None else dtype)
+
+    def perturbed(self, eps, d):
+        """A copy with d added to the constant and to every coefficient
+           larger than eps in magnitude. This is the noise the samplex
+           solvers add to inequalities."""
+        if self.indices.size == 0 or self.indices[0] != 0:
+            b = SparseRow(self.n, np.append(0, self.indices), np.append(0.0, self.values))
+        else:
+            b = self.copy()
+        w = np.abs(b.values) > eps
+        w[0] = True
+        b.values[w] += d
+        return b
+
+    def nonzero(self):
+        return (self.indices[self.values != 0],)
@@ -0,0 +1,375 @@
+from __future__ import division
+import os
+import struct
+import cPickle as pickle
+import numpy as np
+from itertools import izip
+
+from glass.environment import DArray
+
+#===============================================================================
+# Columnar state files.
+#
+# A state file is a fixed header followed by the column data and two pickles:
+#
+#   magic      8 bytes   'GLASSCOL'
+#   version    uint32
+#   (unused)   uint32
+#   toc        uint64 offset, uint64 length      column table
+#   skeleton   uint64 offset, uint64 length      environment without models
+#
+# Every column is a plain little-endian array starting on an ALIGN byte
+# boundary so that it can be used straight from a memory map. The solutions
+# are one contiguous (nsolutions x nvars) float64 column. Every other value
+# in the model dictionaries is stacked over the models into one column per
+# key, named 'model/<key>' for the model itself and '<i>/<key>' or '<i>/sol'
+# for the data and solution of object slot i. A value that is a slice of the
+# model's solution is stored only as the bounds of that slice. Values that
+# cannot be stacked (ragged shapes, python objects) are pickled into the
+# skeleton instead.
+#
+# The column table is small and holds no references to glass objects, so a
+# single column can be read without unpickling the skeleton.
+#===============================================================================
+
+MAGIC   = 'GLASSCOL'
+VERSION = 1
+ALIGN   = 64
+HEADER  = struct.Struct('<8sII4Q')
+
+_PY_SCALARS = (bool, int, long, float, complex)
+
+def is_statefile(fname):
+    with open(fname, 'rb') as f:
+        return f.read(len(MAGIC)) == MAGIC
+
+def _sol_slice(vals, sols):
+    """If every value is a 1-d view into its model's solution, and at the same
+    place in all of them, return the (start,stop) of that place."""
+    bounds = None
+    for v,sol in izip(vals, sols):
+        if type(v) is not np.ndarray or not isinstance(sol, np.ndarray): return None
+        if v.ndim != 1 or sol.ndim != 1 or v.dtype != sol.dtype: return None
+        if v.strides != sol.strides: return None
+        i,r = divmod(v.__array_interface__['data'][0] - sol.__array_interface__['data'][0], sol.itemsize)
+        if r != 0 or i < 0 or i + len(v) > len(sol): return None
+        if bounds is None: bounds = (i, i+len(v))
+        if bounds != (i, i+len(v)): return None
+    return bounds
+
+class _Writer:
+
+    def __init__(self, f, nmodels):
+        self.f       = f
+        self.nmodels = nmodels
+        self.columns = {}
+        self.ragged  = {}
+
+    def array(self, name, rows, dtype, shape, **info):
+        """Write the arrays in rows one after the other as a single column of
+        the given dtype and shape."""
+        dtype = np.dtype(dtype).newbyteorder('<')
+        self.f.write('\0' * (-self.f.tell() % ALIGN))
+        info.update(kind='array', offset=self.f.tell(), dtype=dtype.str, shape=tuple(shape))
+        for r in rows:
+            np.ascontiguousarray(r, dtype=dtype).tofile(self.f)
+        self.columns[name] = info
+
+    def stack(self, name, vals):
+        """Write vals as one column if they are numeric and all of the same
+        type, dtype and shape. Return False if they are not."""
+        t = type(vals[0])
+        if not (t in _PY_SCALARS or t in (np.ndarray, DArray) or issubclass(t, np.generic)):
+            return False
+
+        a = [np.asarray(v) for v in vals]
+        dtype, shape = a[0].dtype, a[0].shape
+        if dtype.kind not in 'biufc': return False
+        for v,x in izip(vals, a):
+            if type(v) is not t or x.dtype != dtype or x.shape != shape: return False
+
+        info = {}
+        if   t in _PY_SCALARS: info['type'] = 'py'
+        elif t is DArray:      info['type'] = 'darray'
+        elif t is np.ndarray:  info['type'] = 'ndarray'
+        else:                  info['type'] = 'numpy'
+
+        if t is DArray:
+            info['attrs'] = name + '#attrs'
+            self.ragged[info['attrs']] = [(v.units, v.symbol) for v in vals]
+
+        if shape == ():
+            self.array(name, [np.array(a, dtype=dtype)], dtype, (self.nmodels,), **info)
+        else:
+            self.array(name, a, dtype, (self.nmodels,) + shape, **info)
+        return True
+
+    def values(self, name, vals, sols=None):
+        """Write the dictionary vals, model index -> value, as a column. Keys
+        missing from some of the models are pickled."""
+        if len(vals) == self.nmodels:
+            v = [vals[i] for i in xrange(self.nmodels)]
+            if sols is not None:
+                s = _sol_slice(v, sols)
+                if s is not None:
+                    self.columns[name] = dict(kind='solslice', start=s[0], stop=s[1])
+                    return
+            if self.stack(name, v):
+                return
+
+        self.ragged[name] = vals
+        self.columns[name] = dict(kind='pickled')
+
+def _slots(models):
+    """The objects, pair type and data type of the 'obj,data' entries, if
+    these are the same for every model. Otherwise None."""
+    slots = None
+    for m in models:
+        od = m.get('obj,data', None)
+        if od is None: return None
+        s = [(p[0], type(p), type(p[1])) for p in od]
+        if slots is None: slots = s
+        if len(s) != len(slots): return None
+        for (o0,p0,d0),(o,p,d) in izip(slots, s):
+            if o is not o0 or p is not p0 or d is not d0: return None
+        osol = m.get('obj,sol', None)
+        if osol is not None and [p[0] for p in osol] != [o for o,_,_ in s]: return None
+    return slots
+
+def save(env, fname):
+    models    = env.models if env.models is not None else []
+    solutions = env.solutions
+    nmodels   = len(models)
+
+    slots = _slots(models) if nmodels else []
+
+    toc  = {'version':    VERSION,
+            'nmodels':    nmodels,
+            'has models': env.models is not None,
+            'nsolutions': None if solutions is None else len(solutions),
+            'layout':     'columns' if slots is not None else 'pickled'}
+    skel = {'env': env}
+
+    #---------------------------------------------------------------------------
+    # The file is written beside the old one and renamed into place, since
+    # models loaded from the old one may still be views into its mapping.
+    #---------------------------------------------------------------------------
+    tmp = fname + '.tmp'
+    try:
+        _write(env, models, solutions, slots, toc, skel, tmp)
+        os.rename(tmp, fname)
+    except:
+        if os.path.exists(tmp): os.remove(tmp)
+        raise
+
+def _write(env, models, solutions, slots, toc, skel, fname):
+    nmodels = len(models)
+    with open(fname, 'wb') as f:
+        f.write('\0' * HEADER.size)
+        w = _Writer(f, nmodels)
+
+        #-----------------------------------------------------------------------
+        # The solutions, and those of models that are not in env.solutions,
+        # as a single block if they all have the same length.
+        #-----------------------------------------------------------------------
+        rows  = list(solutions) if solutions is not None else []
+        index = dict((id(s),i) for i,s in enumerate(rows))
+        for m in models:
+            s = m.get('sol', None)
+            if s is not None and id(s) not in index:
+                index[id(s)] = len(rows)
+                rows.append(s)
+
+        sols = [m.get('sol', None) for m in models]
+        uniform = toc['layout'] == 'columns' \
+              and all(isinstance(s, np.ndarray) and s.ndim == 1 and s.dtype.kind == 'f' for s in rows) \
+              and len(set(len(s) for s in rows)) <= 1
+        if uniform:
+            nvars = len(rows[0]) if rows else 0
+            w.array('solutions', rows, np.float64, (len(rows), nvars))
+            w.array('model/sol', [[index[id(s)] if s is not None else -1 for s in sols]],
+                    np.int64, (nmodels,))
+        else:
+            skel['solutions'] = solutions
+            if toc['layout'] == 'columns':
+                w.values('model/sol', dict(enumerate(sols)))
+
+        #-----------------------------------------------------------------------
+        # Everything else in the models, one column per key.
+        #-----------------------------------------------------------------------
+        if toc['layout'] == 'pickled':
+            skel['models'] = models
+        else:
+            skel['slots'] = []
+            toc['slot keys'] = []
+            toc['has obj,sol'] = all('obj,sol' in m for m in models)
+            for i,(o,pair_type,data_type) in enumerate(slots):
+                d = models[0]['obj,data'][i][1]
+                attrs = d.__getstate__() if hasattr(d, '__getstate__') else getattr(d, '__dict__', None)
+                skel['slots'].append((o, pair_type, data_type, attrs))
+
+                keys = set()
+                for m in models: keys.update(dict.keys(m['obj,data'][i][1]))
+                toc['slot keys'].append(sorted(keys))
+                for k in keys:
+                    vals = dict((j, m['obj,data'][i][1][k]) for j,m in enumerate(models)
+                                                            if dict.__contains__(m['obj,data'][i][1], k))
+                    w.values('%i/%s' % (i,k), vals, sols)
+
+                if toc['has obj,sol']:
+                    w.values('%i/sol' % i, dict((j, m['obj,sol'][i][1]) for j,m in enumerate(models)), sols)
+
+            keys = set()
+            for m in models: keys.update(m.keys())
+            keys -= set(['sol', 'obj,data', 'obj,sol'])
+            toc['model keys'] = sorted(keys)
+            for k in keys:
+                w.values('model/%s' % k, dict((j, m[k]) for j,m in enumerate(models) if k in m))
+
+        if env.accepted_models is not None:
+            ids = dict((id(m),i) for i,m in enumerate(models))
+            acc = [ids[id(m)] for m in env.accepted_models if id(m) in ids]
+            w.array('accepted models', [acc], np.int64, (len(acc),))
+
+        skel['ragged'] = w.ragged
+        toc['columns'] = w.columns
+
+        #-----------------------------------------------------------------------
+        # The environment is pickled without the models, which are all
+        # in the columns above.
+        #-----------------------------------------------------------------------
+        toc_off = f.tell()
+        pickle.dump(toc, f, pickle.HIGHEST_PROTOCOL)
+        skel_off = f.tell()
+
+        stripped = env.models, env.solutions, env.accepted_models
+        env.models = env.solutions = env.accepted_models = None
+        try:
+            pickle.dump(skel, f, pickle.HIGHEST_PROTOCOL)
+        finally:
+            env.models, env.solutions, env.accepted_models = stripped
+        end = f.tell()
+
+        f.seek(0)
+        f.write(HEADER.pack(MAGIC, VERSION, 0, toc_off, skel_off-toc_off, skel_off, end-skel_off))
+        f.flush()
+        os.fsync(f.fileno())
+
+class StateFile(object):
+    """A state file written by save(). The file is memory mapped and columns
+    are only read from disk when they are used."""
+
+    def __init__(self, fname):
+        self.fname = fname
+        with open(fname, 'rb') as f:
+            h = f.read(HEADER.size)
+            assert len(h) == HEADER.size, '%s is not a glass state file.' % fname
+            magic, version, _, toc_off, toc_len, self.skel_off, self.skel_len = HEADER.unpack(h)
+            assert magic == MAGIC, '%s is not a glass state file.' % fname
+            assert version <= VERSION, '%s has unsupported state file version %i.' % (fname, version)
+            f.seek(toc_off)
+            self.toc = pickle.loads(f.read(toc_len))
+
+        self.buf   = np.memmap(fname, dtype=np.uint8, mode='c')
+        self._skel = None
+
+    @property
+    def nmodels(self):
+        return self.toc['nmodels']
+
+    def names(self):
+        return sorted(self.toc['columns'].keys())
+
+    def skeleton(self):
+        if self._skel is None:
+            self._skel = pickle.loads(self.buf[self.skel_off:self.skel_off+self.skel_len].tostring())
+        return self._skel
+
+    def column(self, name):
+        """The column as an array backed by the file, or, for columns that
+        could not be stacked, a dictionary from model index to value."""
+        c = self.toc['columns'][name]
+        if c['kind'] == 'pickled':
+            return self.skeleton()['ragged'][name]
+        assert c['kind'] == 'array', 'Column %s has no data of its own.' % name
+
+        dtype  = np.dtype(c['dtype'])
+        nbytes = dtype.itemsize * int(np.prod(c['shape']))
+        if nbytes == 0:
+            return np.empty(c['shape'], dtype)
+        return np.asarray(self.buf[c['offset']:c['offset']+nbytes]).view(dtype).reshape(c['shape'])
+
+    def _values(self, name, sols):
+        """The values of a column as a list over the models, with None for
+        models that did not have the key."""
+        c = self.toc['columns'][name]
+        if c['kind'] == 'pickled':
+            vals = self.column(name)
+            return [vals.get(i, _Missing) for i in xrange(self.nmodels)]
+        if c['kind'] == 'solslice':
+            return [s[c['start']:c['stop']] for s in sols]
+
+        a = self.column(name)
+        t = c.get('type')
+        if t == 'py':      return a.tolist()
+        if t == 'numpy':   return [a[i] for i in xrange(self.nmodels)]
+        if t == 'ndarray': return list(a)
+        if t == 'darray':
+            vals = []
+            for x,(units,symbol) in izip(a, self.skeleton()['ragged'][c['attrs']]):
+                x = x.view(DArray)
+                x.units, x.symbol = units, symbol
+                vals.append(x)
+            return vals
+        return list(a)
+
+    def environment(self):
+        """Rebuild the environment with its models. Stacked values in the
+        models are views into the memory map."""
+        toc  = self.toc
+        skel = self.skeleton()
+        env  = skel['env']
+        n    = self.nmodels
+
+        if 'solutions' in skel:
+            env.solutions = skel['solutions']
+            if 'model/sol' in toc['columns']:
+                sols = [s if s is not _Missing else None for s in self._values('model/sol', None)]
+        else:
+            rows = list(self.column('solutions'))
+            idx  = self.column('model/sol')
+            env.solutions = rows[:toc['nsolutions']] if toc['nsolutions'] is not None else None
+            sols = [rows[i] if i >= 0 else None for i in idx]
+
+        if not toc['has models']:
+            env.models = None
+        elif toc['layout'] == 'pickled':
+            env.models = skel['models']
+        else:
+            env.models = [{'sol': s} for s in sols]
+
+            for i,(o,pair_type,data_type,attrs) in enumerate(skel.get('slots', [])):
+                ds = []
+                for m in env.models:
+                    d = data_type.__new__(data_type)
+                    if attrs is not None: d.__dict__.update(attrs)
+                    m.setdefault('obj,data', []).append(pair_type([o, d]))
+                    ds.append(d)
+                for k in toc['slot keys'][i]:
+                    for d,v in izip(ds, self._values('%i/%s' % (i,k), sols)):
+                        if v is not _Missing: dict.__setitem__(d, k, v)
+
+                if toc['has obj,sol']:
+                    for m,v in izip(env.models, self._values('%i/sol' % i, sols)):
+                        m.setdefault('obj,sol', []).append(pair_type([o, v]))
+
+            for k in toc.get('model keys', []):
+                for m,v in izip(env.models, self._values('model/%s' % k, sols)):
+                    if v is not _Missing: m[k] = v
+
+        if 'accepted models' in toc['columns']:
+            env.accepted_models = [env.models[i] for i in self.column('accepted models')]
+
+        return env
+
+class _Missing: pass
@@ -75,7 +75,7 @@ except AttributeError:
     numpy_inc = [numpy.get_numpy_include()]
 
 crwalk = Extension('glass.solvers.rwalk.csamplex',
-                     sources = ['glass/solvers/rwalk/csamplex_omp.c', 'glass/solvers/rwalk/WELL44497a.c'],
+                     sources = ['glass/solvers/rwalk/csamplex_omp.c'],
 		     include_dirs=numpy_inc,
              undef_macros=['DEBUG'],
              libraries=libraries,
@@ -98,6 +98,14 @@ samplexsimple = Extension('glass.solvers.samplexsimple.csamplex',
              extra_compile_args=extra_compile_args,
              extra_link_args=extra_link_args)
 
+cpotential = Extension('glass.basis.pixels.cpotential',
+                     sources = ['glass/basis/pixels/cpotential.c'],
+		     include_dirs=numpy_inc,
+             undef_macros=['DEBUG'],
+             libraries=libraries,
+             extra_compile_args=extra_compile_args,
+             extra_link_args=extra_link_args)
+
 setup(name = 'Glass',
       author = 'Jonathan Coles',
       author_email = 'jonathan@jpcoles.com',
@@ -108,7 +116,8 @@ setup(name = 'Glass',
                   'glass.solvers', 'glass.solvers.rwalk',
                   'glass.solvers.samplex',
                   'glass.solvers.samplexsimple',
+                  'glass.solvers.revised',
                   'glass.basis', 'glass.basis.pixels', 'glass.basis.bessel',
                   'glass.massmodel', 'glass.misc'],
-      ext_modules = [crwalk, samplex, samplexsimple])
+      ext_modules = [crwalk, samplex, samplexsimple, cpotential])
 